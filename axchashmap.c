@@ -0,0 +1,248 @@
+//
+// Created by easy on 16.10.26.
+//
+
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+
+#include "axchashmap.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+/* Number of reader counters per parity. Threads are spread over them so that readers rarely share a cache line. */
+#define READER_STRIPES 32
+
+typedef struct ReaderCount {
+    atomic_uint_fast64_t count;
+    char padding[64 - sizeof(atomic_uint_fast64_t)];
+} ReaderCount;
+
+/* A key and value removed by a writer, waiting to be destroyed. Inline keys are copied out of the table. */
+typedef struct Retired {
+    void *key;
+    void *value;
+    uint64_t inlineKey;
+} Retired;
+
+struct axchashmap {
+    axhashmap *_Atomic current;
+    atomic_uint parity;
+    ReaderCount readers[2][READER_STRIPES];
+    pthread_mutex_t writeLock;
+    axhashmap *draft;
+    void (*destroy)(void *, void *);
+    bool inlineKeys;
+    uint64_t span;
+    Retired *retired;
+    uint64_t retiredCount;
+    uint64_t retiredCapacity;
+    axhallocator allocator;
+};
+
+/* The map whose draft is being modified by this thread, so that the destructor of the draft can reach it. */
+static _Thread_local axchashmap *writing;
+
+
+static unsigned stripeIndex(void) {
+    static atomic_uint nextStripe;
+    static _Thread_local unsigned stripe = READER_STRIPES;
+    if (stripe == READER_STRIPES)
+        stripe = atomic_fetch_add(&nextStripe, 1) % READER_STRIPES;
+    return stripe;
+}
+
+static atomic_uint_fast64_t *readBegin(axchashmap *m) {
+    const unsigned parity = atomic_load(&m->parity) & 1;
+    atomic_uint_fast64_t *count = &m->readers[parity][stripeIndex()].count;
+    atomic_fetch_add(count, 1);
+    return count;
+}
+
+static void readEnd(atomic_uint_fast64_t *count) {
+    atomic_fetch_sub(count, 1);
+}
+
+/* Waits until every reader that might have loaded a map published before this call is done. A reader increments its
+   counter before loading the map, so after flipping the parity, the readers of the old parity are the only ones
+   that can still hold the previous map. Flipping twice ensures that a reader that read the parity just before the
+   first flip but incremented its counter after the first wait is waited for as well. */
+static void synchronize(axchashmap *m) {
+    for (int flip = 0; flip < 2; ++flip) {
+        const unsigned parity = atomic_fetch_xor(&m->parity, 1) & 1;
+        for (unsigned stripe = 0; stripe < READER_STRIPES; ++stripe) {
+            while (atomic_load(&m->readers[parity][stripe].count))
+                sched_yield();
+        }
+    }
+}
+
+/* Destructor of drafts. Should remembering the mapping fail for lack of memory, it is leaked rather than destroyed
+   while readers might still see it. */
+static void retire(void *key, void *value) {
+    axchashmap *m = writing;
+    if (m->retiredCount == m->retiredCapacity) {
+        const uint64_t capacity = m->retiredCapacity ? 2 * m->retiredCapacity : 16;
+        Retired *retired = m->allocator.mallocFn(m->allocator.context, capacity * sizeof *retired);
+        if (!retired)
+            return;
+        if (m->retiredCount)
+            memcpy(retired, m->retired, m->retiredCount * sizeof *retired);
+        m->allocator.freeFn(m->allocator.context, m->retired);
+        m->retired = retired;
+        m->retiredCapacity = capacity;
+    }
+    Retired *r = &m->retired[m->retiredCount++];
+    r->key = key;
+    r->value = value;
+    if (m->inlineKeys && key) {
+        r->inlineKey = 0;
+        memcpy(&r->inlineKey, key, m->span);
+        r->key = &r->inlineKey;
+    }
+}
+
+static void endWrite(axchashmap *m) {
+    writing = NULL;
+    m->draft = NULL;
+    m->retiredCount = 0;
+    pthread_mutex_unlock(&m->writeLock);
+}
+
+
+axchashmap *axch_new(axhashmap *h) {
+    const axhallocator allocator = axh_getAllocator(h);
+    axchashmap *m = allocator.callocFn(allocator.context, 1, sizeof *m);
+    if (!m)
+        return NULL;
+    if (pthread_mutex_init(&m->writeLock, NULL)) {
+        allocator.freeFn(allocator.context, m);
+        return NULL;
+    }
+    m->allocator = allocator;
+    axh_setIncremental(h, false);
+    m->destroy = axh_getDestructor(h);
+    m->inlineKeys = axh_isInline(h);
+    m->span = axh_span(h);
+    axh_setDestructor(h, NULL);
+    atomic_init(&m->current, h);
+    return m;
+}
+
+void axch_destroy(axchashmap *m) {
+    axhashmap *h = atomic_load(&m->current);
+    axh_setDestructor(h, m->destroy);
+    axh_destroy(h);
+    const axhallocator allocator = m->allocator;
+    pthread_mutex_destroy(&m->writeLock);
+    allocator.freeFn(allocator.context, m->retired);
+    allocator.freeFn(allocator.context, m);
+}
+
+uint64_t axch_size(axchashmap *m) {
+    atomic_uint_fast64_t *count = readBegin(m);
+    const uint64_t size = axh_size(atomic_load(&m->current));
+    readEnd(count);
+    return size;
+}
+
+bool axch_has(axchashmap *m, void *key) {
+    atomic_uint_fast64_t *count = readBegin(m);
+    const bool found = axh_has(atomic_load(&m->current), key);
+    readEnd(count);
+    return found;
+}
+
+void *axch_get(axchashmap *m, void *key) {
+    atomic_uint_fast64_t *count = readBegin(m);
+    void *value = axh_get(atomic_load(&m->current), key);
+    readEnd(count);
+    return value;
+}
+
+bool axch_tryGet(axchashmap *m, void *key, void *value) {
+    atomic_uint_fast64_t *count = readBegin(m);
+    const bool found = axh_tryGet(atomic_load(&m->current), key, value);
+    readEnd(count);
+    return found;
+}
+
+void *axch_read(axchashmap *m, void *(*f)(axhashmap *, void *), void *arg) {
+    atomic_uint_fast64_t *count = readBegin(m);
+    void *result = f(atomic_load(&m->current), arg);
+    readEnd(count);
+    return result;
+}
+
+axhashmap *axch_begin(axchashmap *m) {
+    pthread_mutex_lock(&m->writeLock);
+    m->draft = axh_copy(atomic_load(&m->current));
+    if (!m->draft) {
+        pthread_mutex_unlock(&m->writeLock);
+        return NULL;
+    }
+    if (m->destroy)
+        axh_setDestructor(m->draft, retire);
+    writing = m;
+    return m->draft;
+}
+
+void axch_commit(axchashmap *m) {
+    axhashmap *old = atomic_load(&m->current);
+    axh_setIncremental(m->draft, false);
+    axh_setDestructor(m->draft, NULL);
+    atomic_store(&m->current, m->draft);
+    synchronize(m);
+    axh_destroy(old);
+    for (uint64_t i = 0; i < m->retiredCount; ++i)
+        m->destroy(m->retired[i].key, m->retired[i].value);
+    endWrite(m);
+}
+
+void axch_abort(axchashmap *m) {
+    axh_setDestructor(m->draft, NULL);
+    axh_destroy(m->draft);
+    endWrite(m);
+}
+
+int axch_map(axchashmap *m, void *key, void *value) {
+    axhashmap *h = axch_begin(m);
+    if (!h)
+        return -1;
+    const int status = axh_map(h, key, value);
+    if (status)
+        axch_abort(m);
+    else
+        axch_commit(m);
+    return status;
+}
+
+int axch_remap(axchashmap *m, void *key, void *value) {
+    axhashmap *h = axch_begin(m);
+    if (!h)
+        return -1;
+    const int status = axh_remap(h, key, value);
+    if (status < 0)
+        axch_abort(m);
+    else
+        axch_commit(m);
+    return status;
+}
+
+int axch_unmap(axchashmap *m, void *key) {
+    axhashmap *h = axch_begin(m);
+    if (!h)
+        return -1;
+    const bool found = axh_unmap(h, key);
+    if (found)
+        axch_commit(m);
+    else
+        axch_abort(m);
+    return found;
+}
@@ -0,0 +1,131 @@
+//
+// Created by easy on 16.10.26.
+//
+
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef AXHASH_AXCHASHMAP_H
+#define AXHASH_AXCHASHMAP_H
+
+#include "axhashmap.h"
+
+/*
+ * axchashmap is a concurrent hashmap for maps that are read by many threads and written rarely. It wraps an ordinary
+ * axhashmap, so lookups run exactly the same Robin-Hood probes as they do on a single thread.
+ *
+ * Readers never block and never retry. A reader announces itself on a per-thread counter, loads the currently
+ * published map and searches it. Writers are serialized by a mutex and never modify a published map. Instead they
+ * work on a private copy, publish it with a single atomic store, then wait for all readers that may still see the
+ * previous map to finish before freeing it. Keys and values removed or replaced by a writer are handed to the
+ * destructor only after that wait as well, so a reader never observes a destroyed key or value while it is reading.
+ *
+ * Since every write copies the whole map, writes cost time proportional to the size of the map. Many changes can be
+ * made at the price of one copy by grouping them between axch_begin() and axch_commit(). The cumulative counters of
+ * axh_stats() are not reliable for a map read by several threads at once.
+ */
+typedef struct axchashmap axchashmap;
+
+
+/**
+ * Create a new concurrent hashmap from an existing hashmap. The hashmap is adopted along with its configuration and
+ * mappings and must not be used directly anymore. Incremental resizing is disabled on it, since lookups would
+ * otherwise modify the map.
+ * @param h The hashmap to adopt.
+ * @return New concurrent hashmap or NULL iff OOM, in which case h is left untouched.
+ */
+axchashmap *axch_new(axhashmap *h);
+
+/**
+ * Destroy all mappings if a destructor is available, then free the concurrent hashmap. No other thread may access
+ * the map anymore at this point.
+ */
+void axch_destroy(axchashmap *m);
+
+/**
+ * Number of mappings as of the currently published map.
+ * @return Number of mappings.
+ */
+uint64_t axch_size(axchashmap *m);
+
+/**
+ * Checks if a mapping with this key exists. Wait-free.
+ * @param key Key with which to search for the mapping.
+ * @return True iff a matching mapping was found.
+ */
+bool axch_has(axchashmap *m, void *key);
+
+/**
+ * Get the value of a mapping. Wait-free. If the destructor frees values, the value must not be accessed once it
+ * may have been unmapped or replaced by some writer. Use axch_read() to access it safely instead.
+ * @param key Key with which to search for the mapping.
+ * @return The value or NULL if no mapping was found.
+ */
+void *axch_get(axchashmap *m, void *key);
+
+/**
+ * Try getting the value of a mapping. Wait-free. The same caveat as for axch_get() applies.
+ * @param key Key with which to search for the mapping.
+ * @param value Pointer to where the value will be written if a matching mapping is found. Nothing is done
+ * otherwise.
+ * @return True iff a matching mapping was found.
+ */
+bool axch_tryGet(axchashmap *m, void *key, void *value);
+
+/**
+ * Call f with the currently published map and an optional argument. All keys and values found in the map stay valid
+ * until f returns. f may use any function of axhashmap that does not modify the map, such as axh_get(),
+ * axh_getMany() or axh_foreach(), and must not call writing functions of the concurrent map.
+ * @param f Function to call.
+ * @param arg Some optional argument that is passed to f.
+ * @return The return value of f.
+ */
+void *axch_read(axchashmap *m, void *(*f)(axhashmap *, void *), void *arg);
+
+/**
+ * Begin a write. Blocks until no other write is in progress, then returns a private copy of the map, which may be
+ * modified freely with the functions of axhashmap until the write is ended by axch_commit() or axch_abort().
+ * Mappings unmapped or replaced in the copy are destroyed only after the copy has been published and no reader
+ * can see them anymore. The write must be ended by the same thread that began it.
+ * @return The map to modify or NULL iff OOM, in which case no write is in progress.
+ */
+axhashmap *axch_begin(axchashmap *m);
+
+/**
+ * Publish the map returned by axch_begin() and end the write. Blocks until all readers of the previous map are done.
+ */
+void axch_commit(axchashmap *m);
+
+/**
+ * Discard the map returned by axch_begin() and end the write. No mapping is destroyed.
+ */
+void axch_abort(axchashmap *m);
+
+/**
+ * Map a key to some value if it does not already exist, as a write of its own.
+ * @param key Key.
+ * @param value Value.
+ * @return -1 if OOM, 0 if a new mapping was created, 1 if the mapping already exists.
+ */
+int axch_map(axchashmap *m, void *key, void *value);
+
+/**
+ * Map a key to some value unconditionally, as a write of its own. A replaced value is destroyed once no reader can
+ * see it anymore.
+ * @param key Key.
+ * @param value Value.
+ * @return -1 if OOM, 0 if a new mapping was created, 1 if an existing mapping was replaced.
+ */
+int axch_remap(axchashmap *m, void *key, void *value);
+
+/**
+ * Unmap a mapping if it exists, as a write of its own. The mapping is destroyed once no reader can see it anymore.
+ * @param key Key with which to search for the mapping.
+ * @return -1 if OOM, 0 if no matching mapping was found, 1 if it was unmapped.
+ */
+int axch_unmap(axchashmap *m, void *key);
+
+#endif //AXHASH_AXCHASHMAP_H
@@ -9,44 +9,397 @@
  */
 
 
+/* For memfd_create() and fallocate(), which back the tables of maps that take snapshots on Linux. */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #include "axhashmap.h"
 #include <string.h>
 #include <stdlib.h>
 #include <xxhash.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 
 static void *(*malloc_)(size_t) = malloc;
 static void *(*calloc_)(size_t, size_t) = calloc;
 static void (*free_)(void *) = free;
 
+/* Number of control bytes inspected at once in metadata mode. */
+#if defined(__AVX2__)
+#define GROUP_WIDTH 32
+#elif defined(__SSE2__)
+#define GROUP_WIDTH 16
+#else
+#define GROUP_WIDTH 8
+#endif
+
+/* The low bits of a stored hash hold the distance of its slot from the home index, saturating at DIST_MASK.
+   Hashes are truncated accordingly, so only the remaining upper bits take part in indexing and comparison. */
+#define DIST_BITS 8
+#define DIST_MASK ((UINT64_C(1) << DIST_BITS) - 1)
+
+/* Number of slots of the old table migrated by each operation during an incremental resize. */
+#define MIGRATE_STEP 32
+
+/* Tables are never shrunk automatically below this number of slots. */
+#define SHRINK_MIN 64
+
+/* Number of keys hashed and prefetched ahead of probing by batch operations. */
+#define BATCH_WIDTH 16
+
+/* Cumulative operation counters are only maintained when compiled with AXH_STATS. */
+#ifdef AXH_STATS
+#define COUNT(h, counter, n) ((h)->counter += (n))
+#else
+#define COUNT(h, counter, n) ((void) 0)
+#endif
+
+/* Control byte of an empty slot. Occupied slots store 0x80 | top 7 bits of their hash. */
+#define CONTROL_EMPTY 0
+
+/* Identifies files written by axh_save(). Reads differently on a machine of the other byte order. */
+#define FILE_MAGIC UINT64_C(0x61786870616d0001)
+#define FILE_VERSION 1
+#define FILE_INLINE 1
+#define FILE_META 2
+
+/* Initial and maximum size of the chunks of an arena. Chunks double in size up to the maximum. */
+#define ARENA_CHUNK (UINT64_C(1) << 12)
+#define ARENA_CHUNK_MAX (UINT64_C(1) << 20)
+/* Arena blocks are multiples of 8 bytes. Freed blocks up to ARENA_CLASSES * 8 bytes are kept in free lists per size,
+   larger blocks are allocated individually. */
+#define ARENA_CLASSES 64
+
+/* Tables of at least this many bytes are aligned to cache lines, or to huge pages if those are enabled. */
+#define ALIGNED_TABLE_BYTES (UINT64_C(1) << 16)
+#define CACHE_LINE 64
+#define HUGE_PAGE (UINT64_C(1) << 21)
+
+/* Smallest number of destination slots worth a thread of their own when building a table in parallel. */
+#define MIN_REGION (UINT64_C(1) << 14)
+#define MAX_THREADS 256
+
+/* Bits per digit of the radix sort of axh_mapBulk(). */
+#define RADIX_BITS 11
+
+/* Tables shared with snapshots are split into blocks of at least SNAPSHOT_BLOCK bytes. Larger tables use larger
+   blocks, since every block may end up in a memory mapping of its own. */
+#define SNAPSHOT_BLOCK (UINT64_C(1) << 21)
+#define SNAPSHOT_MAX_BLOCKS 4096
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    uint64_t size;
+} ArenaChunk;
+
+typedef struct LargeBlock {
+    struct LargeBlock *prev;
+    struct LargeBlock *next;
+} LargeBlock;
+
+typedef struct Arena {
+    axhallocator allocator;
+    ArenaChunk *chunks;
+    char *cursor;
+    char *end;
+    void *freeLists[ARENA_CLASSES + 1];
+    LargeBlock *large;
+    uint64_t bytes;
+} Arena;
+
 typedef struct KeyValue {
     XXH64_hash_t hash;
     void *key;
     void *value;
 } KeyValue;
 
+/* In-memory file holding the blocks of the tables a map shares with its snapshots. A block is never modified once
+   written, and its space is released as soon as no table refers to it anymore. */
+typedef struct SnapshotFile {
+    pthread_mutex_t lock;
+    int fd;
+    uint64_t end;
+    uint64_t users;
+    axhallocator allocator;
+} SnapshotFile;
+
+typedef struct SnapshotBlock {
+    uint64_t offset;
+    uint64_t refs;
+} SnapshotBlock;
+
+/* Table mapped block by block from a snapshot file. The map it belongs to maps it privately, so that its writes leave
+   the file untouched, and records which blocks it has written to since, while snapshots map it read-only. */
+typedef struct SharedTable {
+    SnapshotFile *file;
+    uint64_t blockBytes;
+    uint64_t blockCount;
+    SnapshotBlock **blocks;
+    _Atomic uint64_t *dirty;
+} SharedTable;
+
 struct axhashmap {
     KeyValue *table;
+    uint8_t *meta;
+    KeyValue *oldTable;
+    uint64_t oldTableSize;
+    uint64_t oldSize;
+    uint64_t migrateStart;
+    uint64_t migrateIndex;
     uint64_t rehashThreshold;
     uint64_t size;
     uint64_t tableSize;
     uint64_t staticSpan;
+    bool inlineKeys;
     uint64_t (*toHash)(const void *, uint64_t (*)(const void *, size_t));
     bool (*cmp)(const void *, const void *);
     void (*destroy)(void *, void *);
     double loadFactor;
+    bool incremental;
+    uint64_t rehashes;
+    uint64_t lookups;
+    uint64_t inserts;
+    uint64_t probes;
+    uint64_t compares;
+    void *mapping;
+    uint64_t mappingLength;
+    uintptr_t keyBase;
+    uintptr_t valueBase;
+    Arena *arena;
+    bool ownKeys;
+    uint64_t valueSpan;
+    axhallocator allocator;
+    bool hugePages;
+    double shrinkFactor;
+    uint64_t (*growth)(uint64_t);
+    SharedTable *shared;
 };
 
+/* Header of a saved map. Keys and values in the saved table are offsets from the start of the file. */
+typedef struct FileHeader {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t tableSize;
+    uint64_t size;
+    uint64_t staticSpan;
+    uint64_t valueSpan;
+    uint64_t groupWidth;
+    uint64_t flags;
+    double loadFactor;
+    uint64_t tableOffset;
+    uint64_t metaOffset;
+    uint64_t arenaOffset;
+    uint64_t fileSize;
+} FileHeader;
+
 
 static bool isEmpty(const KeyValue *kv) {
     return !kv->hash && !kv->key;
 }
 
+static void *defaultMalloc(void *context, size_t size) {
+    (void) context;
+    return malloc_(size);
+}
+
+static void *defaultCalloc(void *context, size_t count, size_t size) {
+    (void) context;
+    return calloc_(count, size);
+}
+
+static void *defaultAligned(void *context, size_t alignment, size_t size) {
+    (void) context;
+    return aligned_alloc(alignment, size);
+}
+
+static void defaultFree(void *context, void *p) {
+    (void) context;
+    free_(p);
+}
+
+/* The allocator of maps created without one, using the functions set by axh_memoryfn(). Aligned allocations are
+   only available from the standard library. */
+static axhallocator defaultAllocator(void) {
+    return (axhallocator) {NULL, defaultMalloc, defaultCalloc, free_ == free ? defaultAligned : NULL, defaultFree};
+}
+
+static void *allocate(const axhallocator *a, size_t size) {
+    return a->mallocFn(a->context, size);
+}
+
+static void *allocateZeroed(const axhallocator *a, size_t count, size_t size) {
+    return a->callocFn(a->context, count, size);
+}
+
+static void deallocate(const axhallocator *a, void *p) {
+    a->freeFn(a->context, p);
+}
+
+/* Allocate a table of the given size, which is zeroed if requested. */
+static KeyValue *allocSlots(axhashmap *h, uint64_t tableSize, bool zeroed) {
+    const uint64_t bytes = tableSize * sizeof(KeyValue);
+    if (bytes < ALIGNED_TABLE_BYTES || !h->allocator.alignedFn) {
+        return zeroed ? allocateZeroed(&h->allocator, tableSize, sizeof(KeyValue))
+                      : allocate(&h->allocator, bytes);
+    }
+    const uint64_t alignment = h->hugePages && bytes >= HUGE_PAGE ? HUGE_PAGE : CACHE_LINE;
+    const uint64_t length = (bytes + alignment - 1) & ~(alignment - 1);
+    KeyValue *table = h->allocator.alignedFn(h->allocator.context, alignment, length);
+    if (!table)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (alignment == HUGE_PAGE)
+        madvise(table, length, MADV_HUGEPAGE);
+#endif
+    if (zeroed)
+        memset(table, 0, bytes);
+    return table;
+}
+
+/* Snapshots are only supported on Linux, which offers anonymous files whose space can be released block by block.
+   Elsewhere, there is no file and thus no snapshot. */
+static SnapshotFile *newSnapshotFile(const axhallocator *allocator) {
+#ifdef __linux__
+    SnapshotFile *f = allocate(allocator, sizeof *f);
+    if (!f)
+        return NULL;
+    if ((f->fd = memfd_create("axhashmap", MFD_CLOEXEC)) < 0) {
+        deallocate(allocator, f);
+        return NULL;
+    }
+    pthread_mutex_init(&f->lock, NULL);
+    f->end = 0;
+    f->users = 0;
+    f->allocator = *allocator;
+    return f;
+#else
+    (void) allocator;
+    return NULL;
+#endif
+}
+
+static void releaseFile(SnapshotFile *f) {
+    pthread_mutex_lock(&f->lock);
+    const bool last = !--f->users;
+    pthread_mutex_unlock(&f->lock);
+    if (!last)
+        return;
+    const axhallocator allocator = f->allocator;
+    close(f->fd);
+    pthread_mutex_destroy(&f->lock);
+    deallocate(&allocator, f);
+}
+
+/* Append a block holding the given bytes to the file, which must be locked. Returns NULL if OOM. */
+static SnapshotBlock *appendBlock(SnapshotFile *f, const char *data, uint64_t length, uint64_t blockBytes) {
+    SnapshotBlock *block = allocate(&f->allocator, sizeof *block);
+    if (!block)
+        return NULL;
+    block->offset = f->end;
+    block->refs = 1;
+    if (ftruncate(f->fd, (off_t) (f->end + blockBytes))) {
+        deallocate(&f->allocator, block);
+        return NULL;
+    }
+    for (uint64_t written = 0; written < length;) {
+        const ssize_t n = pwrite(f->fd, data + written, length - written, (off_t) (block->offset + written));
+        if (n <= 0) {
+            deallocate(&f->allocator, block);
+            return NULL;
+        }
+        written += (uint64_t) n;
+    }
+    f->end += blockBytes;
+    return block;
+}
+
+/* Drop a reference to a block of the file, which must be locked. */
+static void releaseBlock(SnapshotFile *f, SnapshotBlock *block, uint64_t blockBytes) {
+    if (--block->refs)
+        return;
+#ifdef __linux__
+    fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) block->offset, (off_t) blockBytes);
+#else
+    (void) blockBytes;
+#endif
+    deallocate(&f->allocator, block);
+}
+
+/* Number of bytes of a table of the given size that fall into the block at index. */
+static uint64_t blockLength(uint64_t bytes, uint64_t index, uint64_t blockBytes) {
+    const uint64_t rest = bytes - index * blockBytes;
+    return rest < blockBytes ? rest : blockBytes;
+}
+
+/* Drop the references of a table to its blocks and its file. Snapshots may do so from any thread. */
+static void releaseShared(SharedTable *s) {
+    SnapshotFile *f = s->file;
+    const axhallocator allocator = f->allocator;
+    pthread_mutex_lock(&f->lock);
+    for (uint64_t i = 0; s->blocks && i < s->blockCount; ++i) {
+        if (s->blocks[i])
+            releaseBlock(f, s->blocks[i], s->blockBytes);
+    }
+    pthread_mutex_unlock(&f->lock);
+    releaseFile(f);
+    deallocate(&allocator, s->blocks);
+    deallocate(&allocator, (void *) s->dirty);
+    deallocate(&allocator, s);
+}
+
+/* A table without blocks yet, which records the blocks written to if it belongs to the map rather than a snapshot.
+   Returns NULL if OOM. */
+static SharedTable *newShared(SnapshotFile *f, uint64_t blockBytes, uint64_t blockCount, bool writable) {
+    pthread_mutex_lock(&f->lock);
+    ++f->users;
+    pthread_mutex_unlock(&f->lock);
+    SharedTable *s = allocate(&f->allocator, sizeof *s);
+    if (!s) {
+        releaseFile(f);
+        return NULL;
+    }
+    s->file = f;
+    s->blockBytes = blockBytes;
+    s->blockCount = blockCount;
+    s->blocks = allocateZeroed(&f->allocator, blockCount, sizeof *s->blocks);
+    s->dirty = writable ? allocateZeroed(&f->allocator, (blockCount + 63) / 64, sizeof *s->dirty) : NULL;
+    if (!s->blocks || (writable && !s->dirty)) {
+        releaseShared(s);
+        return NULL;
+    }
+    return s;
+}
+
 static uint64_t strToHash(const void *str, uint64_t (*_)(const void *, size_t)) {
     (void) _;
     return XXH3_64bits(str, strlen(str));
 }
 
+/* Hashes the keys of maps created by axh_newStrings(), whose length is known. */
+static uint64_t lengthToHash(const void *str, uint64_t (*_)(const void *, size_t)) {
+    (void) _;
+    const axhstring *s = str;
+    return XXH3_64bits(s->data, s->length);
+}
+
+static bool sameString(const axhstring *a, const axhstring *b) {
+    return a->length == b->length && memcmp(a->data, b->data, a->length) == 0;
+}
+
+static uint64_t doubleSize(uint64_t tableSize) {
+    return tableSize * 2;
+}
+
 static bool cmpAddresses(const void *a, const void *b) {
     return a == b;
 }
@@ -73,30 +426,339 @@ static uint64_t probeLength(uint64_t index1, uint64_t index2, uint64_t tableSize
         return tableSize - (index1 - index2);
 }
 
+static uint64_t homeIndex(const KeyValue *kv, uint64_t tableSize) {
+    return computeIndex(kv->hash & ~DIST_MASK, tableSize);
+}
+
+static uint64_t displacement(const KeyValue *kv, uint64_t index, uint64_t tableSize) {
+    const uint64_t dist = kv->hash & DIST_MASK;
+    if (dist < DIST_MASK)
+        return dist;
+    return probeLength(homeIndex(kv, tableSize), index, tableSize);
+}
+
+static void setDisplacement(KeyValue *kv, uint64_t dist) {
+    kv->hash = (kv->hash & ~DIST_MASK) | (dist < DIST_MASK ? dist : DIST_MASK);
+}
+
+/* The control byte keeps bits of the hash just above the distance. The index is taken from its top bits, so these
+   tell the mappings of a group apart. */
+static uint8_t controlByte(XXH64_hash_t hash) {
+    return 0x80 | (hash >> DIST_BITS & 0x7f);
+}
+
+/* Record a write to a slot of a table shared with snapshots, so that the next snapshot stores its blocks anew. */
+static void touch(axhashmap *h, uint64_t index) {
+    if (!h->shared)
+        return;
+    const SharedTable *s = h->shared;
+    const uint64_t last = ((index + 1) * sizeof(KeyValue) - 1) / s->blockBytes;
+    for (uint64_t block = index * sizeof(KeyValue) / s->blockBytes; block <= last; ++block) {
+        /* Regions of a parallel operation may write to the same block at once. */
+        const uint64_t bit = UINT64_C(1) << block % 64;
+        if (!(atomic_load_explicit(&s->dirty[block / 64], memory_order_relaxed) & bit))
+            atomic_fetch_or_explicit(&s->dirty[block / 64], bit, memory_order_relaxed);
+    }
+}
+
+/* Every write to a slot is followed by setting its control byte, which therefore records the write for snapshots as
+   well, even in tables without control bytes. */
+static void setControl(axhashmap *h, uint64_t index, uint8_t control) {
+    touch(h, index);
+    if (!h->meta)
+        return;
+    h->meta[index] = control;
+    /* The first group is mirrored past the end of the table, so a group never has to wrap around. */
+    if (index < GROUP_WIDTH)
+        h->meta[h->tableSize + index] = control;
+}
+
+static uint32_t matchGroup(const uint8_t *group, uint8_t control) {
+#if defined(__AVX2__)
+    const __m256i g = _mm256_loadu_si256((const __m256i *) group);
+    return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(g, _mm256_set1_epi8((char) control)));
+#elif defined(__SSE2__)
+    const __m128i g = _mm_loadu_si128((const __m128i *) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char) control)));
+#else
+    uint32_t mask = 0;
+    for (unsigned i = 0; i < GROUP_WIDTH; ++i)
+        mask |= (uint32_t) (group[i] == control) << i;
+    return mask;
+#endif
+}
+
+static uint8_t *newMeta(axhashmap *h, const KeyValue *table, uint64_t tableSize) {
+    uint8_t *meta = allocate(&h->allocator, tableSize + GROUP_WIDTH);
+    if (!meta)
+        return NULL;
+    for (uint64_t i = 0; i < tableSize + GROUP_WIDTH; ++i) {
+        const KeyValue *kv = &table[i < tableSize ? i : i - tableSize];
+        meta[i] = isEmpty(kv) ? CONTROL_EMPTY : controlByte(kv->hash);
+    }
+    return meta;
+}
+
 static uint64_t hashKey(axhashmap *h, void *key) {
-    if (h->staticSpan)
-        return XXH3_64bits(key, h->staticSpan);
-    else
-        return h->toHash(key, XXH3_64bits);
+    return axh_hash(h, key) & ~DIST_MASK;
+}
+
+static KeyValue makeKV(axhashmap *h, XXH64_hash_t hash, void *key, void *value) {
+    KeyValue kv = {hash, key, value};
+    if (h->inlineKeys) {
+        kv.key = NULL;
+        memcpy(&kv.key, key, h->staticSpan);
+    }
+    return kv;
+}
+
+/* Key pointer of a slot in the table, translating offsets of a memory-mapped map. Not for inline keys. */
+static void *storedKey(axhashmap *h, const KeyValue *kv) {
+    return (void *) (h->keyBase + (uintptr_t) kv->key);
+}
+
+static void *keyOf(axhashmap *h, KeyValue *kv) {
+    return h->inlineKeys ? &kv->key : storedKey(h, kv);
+}
+
+static void *valueOf(axhashmap *h, const KeyValue *kv) {
+    return h->valueBase && kv->value ? (void *) (h->valueBase + (uintptr_t) kv->value) : kv->value;
 }
 
+/* Whether the slot kv1 of the table holds the key of kv2. */
 static bool matches(axhashmap *h, const KeyValue *kv1, const KeyValue *kv2) {
-    if (kv1->hash != kv2->hash)
+    if ((kv1->hash ^ kv2->hash) & ~DIST_MASK)
         return false;
+    else if (h->inlineKeys)
+        return kv1->key == kv2->key;
     else if (h->staticSpan)
-        return memcmp(kv1->key, kv2->key, h->staticSpan) == 0;
+        return memcmp(storedKey(h, kv1), kv2->key, h->staticSpan) == 0;
+    else if (h->toHash == lengthToHash && h->cmp == cmpAddresses)
+        return sameString(storedKey(h, kv1), kv2->key);
     else if (h->toHash == strToHash && h->cmp == cmpAddresses)
-        return strcmp(kv1->key, kv2->key) == 0;
+        return strcmp(storedKey(h, kv1), kv2->key) == 0;
     else
-        return h->cmp(kv1->key, kv2->key);
+        return h->cmp(storedKey(h, kv1), kv2->key);
+}
+
+/* Memory-mapped maps cannot be modified. */
+static bool readOnly(axhashmap *h) {
+    return h->mapping;
 }
 
 static bool crowded(axhashmap *h) {
     return h->size >= h->rehashThreshold;
 }
 
+/* Size the growth policy picks after the given one. A policy that does not grow the table is overruled by doubling. */
+static uint64_t grownSize(axhashmap *h, uint64_t tableSize) {
+    const uint64_t next = h->growth(tableSize);
+    return next > tableSize ? next : doubleSize(tableSize);
+}
+
 static uint64_t nextTableSize(axhashmap *h) {
-    return h->tableSize * 2;
+    return grownSize(h, h->tableSize);
+}
+
+/* Smallest table size whose load factor admits the given number of mappings, or 0 if there is none. */
+static uint64_t fittingTableSize(axhashmap *h, uint64_t count) {
+    if (h->loadFactor <= 0 || (double) count / h->loadFactor >= 0x1p64)
+        return 0;
+    uint64_t tableSize = (uint64_t) ((double) count / h->loadFactor);
+    while (tableSize && (uint64_t) ((double) (tableSize - 1) * h->loadFactor) >= count)
+        --tableSize;
+    while ((uint64_t) ((double) tableSize * h->loadFactor) < count)
+        ++tableSize;
+    return tableSize ? tableSize : 1;
+}
+
+/* Allocate an empty table for h into h2, along with control bytes if withMeta is set. Returns true if OOM. */
+static bool allocTable(axhashmap *h, axhashmap *h2, uint64_t tableSize, bool withMeta) {
+    h2->tableSize = tableSize;
+    h2->meta = NULL;
+    h2->shared = NULL;
+    if (!(h2->table = allocSlots(h, tableSize, true)))
+        return true;
+    if (withMeta && !(h2->meta = allocateZeroed(&h->allocator, tableSize + GROUP_WIDTH, sizeof *h2->meta))) {
+        deallocate(&h->allocator, h2->table);
+        return true;
+    }
+    return false;
+}
+
+/* View of either table of a map that is being resized incrementally, behaving like a map of its own. */
+static axhashmap tableView(axhashmap *h, bool old) {
+    axhashmap view = *h;
+    view.oldTable = NULL;
+    view.oldTableSize = 0;
+    view.oldSize = 0;
+    if (old) {
+        view.table = h->oldTable;
+        view.meta = NULL;
+        view.shared = NULL;
+        view.tableSize = h->oldTableSize;
+        view.size = h->oldSize;
+    } else {
+        view.size = h->size - h->oldSize;
+    }
+    return view;
+}
+
+static bool inOldTable(axhashmap *h, const KeyValue *kv) {
+    return h->oldTable && kv >= h->oldTable && kv < &h->oldTable[h->oldTableSize];
+}
+
+static uint64_t blockSize(uint64_t size) {
+    return (size + 7) & ~UINT64_C(7);
+}
+
+static void *arenaAlloc(Arena *a, uint64_t size) {
+    size = blockSize(size);
+    if (size > ARENA_CLASSES * 8) {
+        LargeBlock *block = allocate(&a->allocator, sizeof *block + size);
+        if (!block)
+            return NULL;
+        block->prev = NULL;
+        block->next = a->large;
+        if (a->large)
+            a->large->prev = block;
+        a->large = block;
+        a->bytes += sizeof *block + size;
+        return block + 1;
+    }
+
+    void **freeList = &a->freeLists[size / 8];
+    if (*freeList) {
+        void *block = *freeList;
+        *freeList = *(void **) block;
+        return block;
+    }
+    if ((uint64_t) (a->end - a->cursor) < size) {
+        uint64_t chunkSize = a->chunks ? 2 * a->chunks->size : ARENA_CHUNK;
+        chunkSize = chunkSize < ARENA_CHUNK_MAX ? chunkSize : ARENA_CHUNK_MAX;
+        ArenaChunk *chunk = allocate(&a->allocator, sizeof *chunk + chunkSize);
+        if (!chunk)
+            return NULL;
+        chunk->next = a->chunks;
+        chunk->size = chunkSize;
+        a->chunks = chunk;
+        a->cursor = (char *) (chunk + 1);
+        a->end = a->cursor + chunkSize;
+        a->bytes += sizeof *chunk + chunkSize;
+    }
+    void *block = a->cursor;
+    a->cursor += size;
+    return block;
+}
+
+static void arenaFree(Arena *a, void *p, uint64_t size) {
+    size = blockSize(size);
+    if (size > ARENA_CLASSES * 8) {
+        LargeBlock *block = (LargeBlock *) p - 1;
+        if (block->prev)
+            block->prev->next = block->next;
+        else
+            a->large = block->next;
+        if (block->next)
+            block->next->prev = block->prev;
+        a->bytes -= sizeof *block + size;
+        deallocate(&a->allocator, block);
+        return;
+    }
+    *(void **) p = a->freeLists[size / 8];
+    a->freeLists[size / 8] = p;
+}
+
+/* Free everything allocated from the arena, but keep its newest chunk for reuse. */
+static void arenaReset(Arena *a) {
+    while (a->large) {
+        LargeBlock *next = a->large->next;
+        deallocate(&a->allocator, a->large);
+        a->large = next;
+    }
+    ArenaChunk *kept = a->chunks;
+    if (kept) {
+        for (ArenaChunk *chunk = kept->next, *next; chunk; chunk = next) {
+            next = chunk->next;
+            deallocate(&a->allocator, chunk);
+        }
+        kept->next = NULL;
+        a->cursor = (char *) (kept + 1);
+        a->end = a->cursor + kept->size;
+    }
+    memset(a->freeLists, 0, sizeof a->freeLists);
+    a->bytes = kept ? sizeof *kept + kept->size : 0;
+}
+
+static Arena *newArena(axhashmap *h) {
+    Arena *a = allocateZeroed(&h->allocator, 1, sizeof *a);
+    if (a)
+        a->allocator = h->allocator;
+    return a;
+}
+
+static void arenaDestroy(Arena *a) {
+    if (!a)
+        return;
+    const axhallocator allocator = a->allocator;
+    arenaReset(a);
+    deallocate(&allocator, a->chunks);
+    deallocate(&allocator, a);
+}
+
+/* Length of the copy of a key in the arena. Strings of known length are copied along with their bytes, which are
+   null-terminated for convenience. */
+static uint64_t keyLength(axhashmap *h, const void *key) {
+    if (h->staticSpan)
+        return h->staticSpan;
+    if (h->toHash == lengthToHash)
+        return sizeof(axhstring) + ((const axhstring *) key)->length + 1;
+    return strlen(key) + 1;
+}
+
+static void copyKey(axhashmap *h, void *copy, const void *key, uint64_t length) {
+    if (h->toHash != lengthToHash) {
+        memcpy(copy, key, length);
+        return;
+    }
+    const axhstring *s = key;
+    axhstring *c = copy;
+    char *data = (char *) (c + 1);
+    memcpy(data, s->data, s->length);
+    data[s->length] = 0;
+    c->length = s->length;
+    c->data = data;
+}
+
+/* Replace the key and value of kv by copies in the arena, as far as the map owns them. Returns true if OOM. */
+static bool ownMapping(axhashmap *h, KeyValue *kv) {
+    void *key = kv->key;
+    if (h->ownKeys) {
+        const uint64_t length = keyLength(h, key);
+        if (!(kv->key = arenaAlloc(h->arena, length)))
+            return true;
+        copyKey(h, kv->key, key, length);
+    }
+    if (h->valueSpan && kv->value) {
+        void *value = arenaAlloc(h->arena, h->valueSpan);
+        if (!value) {
+            if (h->ownKeys)
+                arenaFree(h->arena, kv->key, keyLength(h, kv->key));
+            kv->key = key;
+            return true;
+        }
+        memcpy(value, kv->value, h->valueSpan);
+        kv->value = value;
+    }
+    return false;
+}
+
+/* Return the copies owned by the map of a mapping to the arena. */
+static void releaseMapping(axhashmap *h, KeyValue *kv) {
+    if (h->ownKeys)
+        arenaFree(h->arena, kv->key, keyLength(h, kv->key));
+    if (h->valueSpan && kv->value)
+        arenaFree(h->arena, kv->value, h->valueSpan);
 }
 
 
@@ -112,6 +774,17 @@ uint64_t axh_span(axhashmap *h) {
     return h->staticSpan;
 }
 
+bool axh_isInline(axhashmap *h) {
+    return h->inlineKeys;
+}
+
+uint64_t axh_hash(axhashmap *h, void *key) {
+    if (h->staticSpan)
+        return XXH3_64bits(key, h->staticSpan);
+    else
+        return h->toHash(key, XXH3_64bits);
+}
+
 axhashmap *axh_setLoadFactor(axhashmap *h, double lf) {
     if (lf < 0) lf = 0;
     if (lf > 1) lf = 1;
@@ -124,6 +797,26 @@ double axh_getLoadFactor(axhashmap *h) {
     return h->loadFactor;
 }
 
+axhashmap *axh_setShrinkFactor(axhashmap *h, double sf) {
+    if (sf < 0) sf = 0;
+    if (sf > 1) sf = 1;
+    h->shrinkFactor = sf;
+    return h;
+}
+
+double axh_getShrinkFactor(axhashmap *h) {
+    return h->shrinkFactor;
+}
+
+axhashmap *axh_setGrowth(axhashmap *h, uint64_t (*growth)(uint64_t)) {
+    h->growth = growth ? growth : doubleSize;
+    return h;
+}
+
+uint64_t (*axh_getGrowth(axhashmap *h))(uint64_t) {
+    return h->growth;
+}
+
 axhashmap *axh_setComparator(axhashmap *h, bool (*cmp)(const void *, const void *)) {
     h->cmp = cmp ? cmp : cmpAddresses;
     return h;
@@ -151,6 +844,58 @@ void (*axh_getDestructor(axhashmap *h))(void *, void *) {
     return h->destroy;
 }
 
+bool axh_setMetadata(axhashmap *h, bool enable) {
+    if (readOnly(h))
+        return true;
+    if (!enable) {
+        deallocate(&h->allocator, h->meta);
+        h->meta = NULL;
+        return false;
+    }
+    if (h->meta)
+        return false;
+    if (h->tableSize < GROUP_WIDTH && axh_rehash(h, GROUP_WIDTH))
+        return true;
+    return !(h->meta = newMeta(h, h->table, h->tableSize));
+}
+
+bool axh_hasMetadata(axhashmap *h) {
+    return h->meta;
+}
+
+bool axh_setArena(axhashmap *h, bool ownKeys, uint64_t valueSpan) {
+    ownKeys = ownKeys && !h->inlineKeys;
+    if (h->size || readOnly(h) || (ownKeys && !h->staticSpan && h->toHash != strToHash && h->toHash != lengthToHash))
+        return true;
+    if (!ownKeys && !valueSpan) {
+        arenaDestroy(h->arena);
+        h->arena = NULL;
+    } else if (!h->arena && !(h->arena = newArena(h))) {
+        return true;
+    }
+    h->ownKeys = ownKeys;
+    h->valueSpan = valueSpan;
+    return false;
+}
+
+static void finishMigration(axhashmap *h);
+
+axhashmap *axh_setIncremental(axhashmap *h, bool enable) {
+    h->incremental = enable;
+    if (!enable)
+        finishMigration(h);
+    return h;
+}
+
+bool axh_getIncremental(axhashmap *h) {
+    return h->incremental;
+}
+
+axhashmap *axh_setHugePages(axhashmap *h, bool enable) {
+    h->hugePages = enable;
+    return h;
+}
+
 void axh_memoryfn(void *(*malloc_fn)(size_t), void *(*calloc_fn)(size_t, size_t), void (*free_fn)(void *)) {
     malloc_ = malloc_fn ? malloc_fn : malloc;
     calloc_ = calloc_fn ? calloc_fn : calloc;
@@ -158,76 +903,223 @@ void axh_memoryfn(void *(*malloc_fn)(size_t), void *(*calloc_fn)(size_t, size_t)
 }
 
 
-axhashmap *axh_newSized(uint64_t span, uint64_t tableSize, double loadFactor) {
+axhashmap *axh_newWith(const axhallocator *allocator, uint64_t span, uint64_t tableSize, double loadFactor) {
     tableSize += !tableSize;
-    axhashmap *h = malloc_(sizeof *h);
-    if (!h || !(h->table = calloc_(tableSize, sizeof *h->table))) {
-        free_(h);
+    axhashmap *h = allocate(allocator, sizeof *h);
+    if (!h)
+        return NULL;
+    h->allocator = *allocator;
+    h->hugePages = false;
+    if (!(h->table = allocSlots(h, tableSize, true))) {
+        deallocate(allocator, h);
         return NULL;
     }
+    h->meta = NULL;
+    h->oldTable = NULL;
+    h->oldTableSize = 0;
+    h->oldSize = 0;
+    h->migrateStart = 0;
+    h->migrateIndex = 0;
     h->rehashThreshold = (uint64_t) ((double) tableSize * loadFactor);
     h->size = 0;
     h->tableSize = tableSize;
     h->staticSpan = span;
+    h->inlineKeys = false;
     h->toHash = strToHash;
     h->cmp = cmpAddresses;
     h->destroy = NULL;
     h->loadFactor = loadFactor;
+    h->incremental = false;
+    h->rehashes = 0;
+    h->lookups = 0;
+    h->inserts = 0;
+    h->probes = 0;
+    h->compares = 0;
+    h->mapping = NULL;
+    h->mappingLength = 0;
+    h->keyBase = 0;
+    h->valueBase = 0;
+    h->arena = NULL;
+    h->ownKeys = false;
+    h->valueSpan = 0;
+    h->shrinkFactor = 0;
+    h->growth = doubleSize;
+    h->shared = NULL;
     return h;
 }
 
+axhallocator axh_getAllocator(axhashmap *h) {
+    return h->allocator;
+}
+
+axhashmap *axh_newSized(uint64_t span, uint64_t tableSize, double loadFactor) {
+    const axhallocator allocator = defaultAllocator();
+    return axh_newWith(&allocator, span, tableSize, loadFactor);
+}
+
 axhashmap *axh_new(uint64_t span) {
     return axh_newSized(span, 16, 2./3.);
 }
 
-void axh_destroy(axhashmap *h) {
-    if (h->destroy) {
-        KeyValue *kv = h->table;
-        for (uint64_t mapped = 0; mapped < h->size; ++kv) {
-            if (!isEmpty(kv)) {
-                h->destroy(kv->key, kv->value);
-                ++mapped;
-            }
+axhashmap *axh_newInlineSized(uint64_t span, uint64_t tableSize, double loadFactor) {
+    if (!span || span > sizeof(void *))
+        return NULL;
+    axhashmap *h = axh_newSized(span, tableSize, loadFactor);
+    if (h)
+        h->inlineKeys = true;
+    return h;
+}
+
+axhashmap *axh_newInline(uint64_t span) {
+    return axh_newInlineSized(span, 16, 2./3.);
+}
+
+axhashmap *axh_newStringsSized(uint64_t tableSize, double loadFactor) {
+    axhashmap *h = axh_newSized(0, tableSize, loadFactor);
+    if (h)
+        h->toHash = lengthToHash;
+    return h;
+}
+
+axhashmap *axh_newStrings(void) {
+    return axh_newStringsSized(16, 2./3.);
+}
+
+static void destroyMappings(axhashmap *h) {
+    if (!h->destroy)
+        return;
+    KeyValue *kv = h->table;
+    for (uint64_t mapped = 0; mapped < h->size; ++kv) {
+        if (!isEmpty(kv)) {
+            h->destroy(keyOf(h, kv), kv->value);
+            ++mapped;
         }
     }
-    free_(h->table);
-    free_(h);
+}
+
+/* Free the current table, which is not allocated but mapped if it is shared with snapshots. */
+static void freeTable(axhashmap *h) {
+    if (!h->shared) {
+        deallocate(&h->allocator, h->table);
+        return;
+    }
+    munmap(h->table, h->shared->blockCount * h->shared->blockBytes);
+    releaseShared(h->shared);
+    h->shared = NULL;
+}
+
+static void endMigration(axhashmap *h) {
+    deallocate(&h->allocator, h->oldTable);
+    h->oldTable = NULL;
+    h->oldTableSize = 0;
+    h->oldSize = 0;
+}
+
+void axh_destroy(axhashmap *h) {
+    const axhallocator allocator = h->allocator;
+    if (readOnly(h)) {
+        munmap(h->mapping, h->mappingLength);
+        if (h->shared)
+            releaseShared(h->shared);
+        deallocate(&allocator, h);
+        return;
+    }
+    if (h->oldTable) {
+        axhashmap old = tableView(h, true);
+        destroyMappings(&old);
+        endMigration(h);
+    }
+    destroyMappings(h);
+    arenaDestroy(h->arena);
+    freeTable(h);
+    deallocate(&allocator, h->meta);
+    deallocate(&allocator, h);
+}
+
+/* Swap key and value of a mapping with those of kv. */
+static void replace(KeyValue *selection, KeyValue *kv) {
+    void *key = selection->key;
+    void *value = selection->value;
+    selection->key = kv->key;
+    selection->value = kv->value;
+    kv->key = key;
+    kv->value = value;
 }
 
 static bool unsafeMap(axhashmap *h, KeyValue *kv, const bool mightMatch, const bool remap) {
-    uint64_t index = computeIndex(kv->hash, h->tableSize);
+    uint64_t index = homeIndex(kv, h->tableSize);
+    uint64_t kvProbes = 0;
     KeyValue *selection = &h->table[index];
-    for (uint64_t kvProbes = 0; !isEmpty(selection); ++kvProbes) {
+    for (; !isEmpty(selection); ++kvProbes) {
         if (mightMatch && matches(h, selection, kv)) {
             if (remap) {
-                void *value = selection->value;
-                *selection = *kv;
-                kv->value = value;
+                replace(selection, kv);
+                touch(h, index);
             }
             return true;
         }
 
-        const uint64_t selectionProbes = probeLength(computeIndex(selection->hash, h->tableSize), index, h->tableSize);
+        const uint64_t selectionProbes = displacement(selection, index, h->tableSize);
         if (kvProbes > selectionProbes) {
+            setDisplacement(kv, kvProbes);
             KeyValue tmp = *selection;
             *selection = *kv;
             *kv = tmp;
             kvProbes = selectionProbes;
+            setControl(h, index, controlByte(selection->hash));
         }
 
         index = mod1(index + 1, h->tableSize);
         selection = &h->table[index];
     }
+    setDisplacement(kv, kvProbes);
     *selection = *kv;
+    setControl(h, index, controlByte(kv->hash));
     ++h->size;
     return false;
 }
 
+/* Move mappings from the old table into the current one, visiting at most the given number of old slots. */
+static void migrate(axhashmap *h, uint64_t slots) {
+    for (; h->oldTable && slots; --slots) {
+        KeyValue *kv = &h->oldTable[h->migrateIndex];
+        h->migrateIndex = mod1(h->migrateIndex + 1, h->oldTableSize);
+        if (isEmpty(kv))
+            continue;
+
+        KeyValue moved = *kv;
+        *kv = (KeyValue) {0};
+        --h->size;
+        unsafeMap(h, &moved, false, false);
+        if (!--h->oldSize)
+            endMigration(h);
+    }
+}
+
+static void finishMigration(axhashmap *h) {
+    migrate(h, UINT64_MAX);
+}
+
+/* Replace the table of h by the fully populated table of h2. */
+static void installTable(axhashmap *h, axhashmap *h2) {
+    freeTable(h);
+    deallocate(&h->allocator, h->meta);
+    h->table = h2->table;
+    h->meta = h2->meta;
+    h->tableSize = h2->tableSize;
+    h->rehashThreshold = (uint64_t) ((double) h->tableSize * h->loadFactor);
+}
+
 bool axh_rehash(axhashmap *h, uint64_t tableSize) {
-    axhashmap h2 = {.tableSize = tableSize};
+    if (readOnly(h))
+        return true;
+    finishMigration(h);
+    if (h->meta && tableSize < GROUP_WIDTH)
+        tableSize = GROUP_WIDTH;
+    axhashmap h2 = {0};
     if (tableSize < h->size)
         return true;
-    if (!(h2.table = calloc_(tableSize, sizeof *h2.table)))
+    if (allocTable(h, &h2, tableSize, h->meta))
         return true;
     for (uint64_t i = 0, mapped = 0; mapped < h->size; ++i) {
         KeyValue *selection = &h->table[i];
@@ -236,151 +1128,1812 @@ bool axh_rehash(axhashmap *h, uint64_t tableSize) {
             ++mapped;
         }
     }
-    free_(h->table);
-    h->table = h2.table;
+    installTable(h, &h2);
+    ++h->rehashes;
+    return false;
+}
+
+/* Replace the table by an empty one and let subsequent operations migrate the mappings over bit by bit. */
+static bool startMigration(axhashmap *h, uint64_t tableSize) {
+    finishMigration(h);
+    /* Migration must begin at the start of a cluster, i.e. at an empty slot or a mapping at its home index. */
+    uint64_t start = 0;
+    while (start < h->tableSize && !isEmpty(&h->table[start]) && displacement(&h->table[start], start, h->tableSize))
+        ++start;
+    /* Emptying the slots of a table shared with snapshots would only have it stored anew. */
+    if (!h->size || start == h->tableSize || h->shared)
+        return axh_rehash(h, tableSize);
+
+    if (h->meta && tableSize < GROUP_WIDTH)
+        tableSize = GROUP_WIDTH;
+    axhashmap h2 = {0};
+    if (allocTable(h, &h2, tableSize, h->meta))
+        return true;
+    deallocate(&h->allocator, h->meta);
+    h->oldTable = h->table;
+    h->oldTableSize = h->tableSize;
+    h->oldSize = h->size;
+    h->migrateStart = start;
+    h->migrateIndex = start;
+    h->table = h2.table;
+    h->meta = h2.meta;
     h->tableSize = tableSize;
     h->rehashThreshold = (uint64_t) ((double) tableSize * h->loadFactor);
+    ++h->rehashes;
     return false;
 }
 
-int axh_map(axhashmap *h, void *key, void *value) {
-    if (crowded(h) && axh_rehash(h, nextTableSize(h)))
+static bool grow(axhashmap *h) {
+    if (h->incremental)
+        return startMigration(h, nextTableSize(h));
+    return axh_rehash(h, nextTableSize(h));
+}
+
+/* Halve the table for as long as the load stays at most half the load factor, once it has dropped below the shrink
+   factor. The shrink factor is capped at a quarter of the load factor, so the map can neither grow nor shrink again
+   right after shrinking. If OOM, the table is simply kept. */
+static void shrink(axhashmap *h) {
+    const double lowWater = h->shrinkFactor < h->loadFactor / 4 ? h->shrinkFactor : h->loadFactor / 4;
+    if (h->oldTable || (double) h->size >= (double) h->tableSize * lowWater)
+        return;
+    uint64_t tableSize = h->tableSize;
+    while (tableSize / 2 >= SHRINK_MIN && (double) h->size <= (double) (tableSize / 2) * h->loadFactor / 2)
+        tableSize /= 2;
+    if (tableSize == h->tableSize)
+        return;
+    if (h->incremental)
+        startMigration(h, tableSize);
+    else
+        axh_rehash(h, tableSize);
+}
+
+bool axh_shrinkToFit(axhashmap *h) {
+    if (readOnly(h))
+        return true;
+    const uint64_t tableSize = fittingTableSize(h, h->size + 1);
+    return tableSize && tableSize < h->tableSize && axh_rehash(h, tableSize);
+}
+
+bool axh_reserve(axhashmap *h, uint64_t count) {
+    if (readOnly(h))
+        return true;
+    const uint64_t tableSize = fittingTableSize(h, count);
+    if (!tableSize)
+        return true;
+    return tableSize > h->tableSize && axh_rehash(h, tableSize);
+}
+
+static KeyValue *locateGroups(axhashmap *h, const KeyValue *kv) {
+    const uint8_t control = controlByte(kv->hash);
+    uint64_t index = homeIndex(kv, h->tableSize);
+
+    for (uint64_t scanned = 0; scanned < h->tableSize; scanned += GROUP_WIDTH) {
+        COUNT(h, probes, 1);
+        const uint8_t *group = &h->meta[index];
+        const uint32_t empty = matchGroup(group, CONTROL_EMPTY);
+        uint32_t candidates = matchGroup(group, control);
+        /* Robin-Hood clusters are contiguous, so nothing past the first empty slot can match. */
+        if (empty)
+            candidates &= (empty & -empty) - 1;
+
+        for (; candidates; candidates &= candidates - 1) {
+            KeyValue *selection = &h->table[mod1(index + __builtin_ctz(candidates), h->tableSize)];
+            COUNT(h, compares, 1);
+            if (matches(h, selection, kv))
+                return selection;
+        }
+        if (empty)
+            return NULL;
+
+        index = mod1(index + GROUP_WIDTH, h->tableSize);
+    }
+
+    return NULL;
+}
+
+/* Walk the probe sequence of kv from index onwards, where kvProbes is the distance from its home. If no mapping matches,
+   index and kvProbes are left at the slot where kv would have to be placed. */
+static KeyValue *probe(axhashmap *h, const KeyValue *kv, uint64_t *index, uint64_t *kvProbes) {
+    KeyValue *selection = &h->table[*index];
+
+    for (; !isEmpty(selection); ++*kvProbes) {
+        COUNT(h, probes, 1);
+        COUNT(h, compares, 1);
+        if (matches(h, selection, kv))
+            return selection;
+
+        if (*kvProbes > displacement(selection, *index, h->tableSize))
+            return NULL;
+
+        *index = mod1(*index + 1, h->tableSize);
+        selection = &h->table[*index];
+    }
+
+    return NULL;
+}
+
+static KeyValue *locateFrom(axhashmap *h, const KeyValue *kv, uint64_t index, uint64_t kvProbes) {
+    return probe(h, kv, &index, &kvProbes);
+}
+
+static KeyValue *locateOld(axhashmap *h, const KeyValue *kv) {
+    axhashmap old = tableView(h, true);
+    const uint64_t home = homeIndex(kv, old.tableSize);
+    const uint64_t migrated = probeLength(h->migrateStart, h->migrateIndex, old.tableSize);
+    /* Slots from migrateStart up to migrateIndex have been emptied. No chain crosses migrateStart, so a chain
+       whose home lies within the emptied range now continues at migrateIndex. */
+    KeyValue *selection;
+    if (probeLength(h->migrateStart, home, old.tableSize) < migrated)
+        selection = locateFrom(&old, kv, h->migrateIndex, probeLength(home, h->migrateIndex, old.tableSize));
+    else
+        selection = locateFrom(&old, kv, home, 0);
+    h->probes = old.probes;
+    h->compares = old.compares;
+    return selection;
+}
+
+static KeyValue *locateKV(axhashmap *h, const KeyValue *kv) {
+    COUNT(h, lookups, 1);
+    KeyValue *selection = h->meta ? locateGroups(h, kv) : locateFrom(h, kv, homeIndex(kv, h->tableSize), 0);
+    if (!selection && h->oldTable)
+        selection = locateOld(h, kv);
+    return selection;
+}
+
+/* Locate the mapping of a key whose hash is known. Only the bits of the hash the table uses are considered. */
+static KeyValue *locateHashed(axhashmap *h, void *key, uint64_t hash) {
+    migrate(h, MIGRATE_STEP);
+    const KeyValue kv = makeKV(h, hash & ~DIST_MASK, key, NULL);
+    return locateKV(h, &kv);
+}
+
+static KeyValue *locate(axhashmap *h, void *key) {
+    return locateHashed(h, key, hashKey(h, key));
+}
+
+static int insert(axhashmap *h, KeyValue *kv) {
+    if (readOnly(h))
+        return -1;
+    if (crowded(h) && grow(h))
+        return -1;
+    if (h->oldTable && locateOld(h, kv))
+        return 1;
+    if (h->arena && ownMapping(h, kv))
         return -1;
-    KeyValue kv = {hashKey(h, key), key, value};
-    return unsafeMap(h, &kv, true, false);
+    const bool exists = unsafeMap(h, kv, true, false);
+    if (exists && h->arena)
+        releaseMapping(h, kv);
+    COUNT(h, inserts, !exists);
+    return exists;
+}
+
+int axh_map(axhashmap *h, void *key, void *value) {
+    return axh_mapHashed(h, key, value, hashKey(h, key));
+}
+
+int axh_mapHashed(axhashmap *h, void *key, void *value, uint64_t hash) {
+    migrate(h, MIGRATE_STEP);
+    KeyValue kv = makeKV(h, hash & ~DIST_MASK, key, value);
+    return insert(h, &kv);
 }
 
 int axh_remap(axhashmap *h, void *key, void *value) {
-    if (crowded(h) && axh_rehash(h, nextTableSize(h)))
+    return axh_remapHashed(h, key, value, hashKey(h, key));
+}
+
+int axh_remapHashed(axhashmap *h, void *key, void *value, uint64_t hash) {
+    if (readOnly(h))
         return -1;
-    KeyValue kv = {hashKey(h, key), key, value};
-    bool status = unsafeMap(h, &kv, true, true);
+    migrate(h, MIGRATE_STEP);
+    if (crowded(h) && grow(h))
+        return -1;
+    KeyValue kv = makeKV(h, hash & ~DIST_MASK, key, value);
+    if (h->arena && ownMapping(h, &kv))
+        return -1;
+    KeyValue *old = h->oldTable ? locateOld(h, &kv) : NULL;
+    bool status = true;
+    if (old)
+        replace(old, &kv);
+    else
+        status = unsafeMap(h, &kv, true, true);
+    COUNT(h, inserts, !status);
     if (status && h->destroy)
         h->destroy(NULL, kv.value);
+    if (status && h->arena)
+        releaseMapping(h, &kv);
     return status;
 }
 
-int axh_add(axhashmap *h, void *key) {
-    return axh_map(h, key, key);
-}
-
-static KeyValue *locate(axhashmap *h, void *key) {
-    XXH64_hash_t hash = hashKey(h, key);
-    uint64_t index = computeIndex(hash, h->tableSize);
-    const KeyValue kv = {hash, key, NULL};
+/* Like unsafeMap(), but kv is known not to be mapped and is placed at index or past it, where kvProbes is its distance
+   from its home. Returns the slot kv ends up in. */
+static KeyValue *placeFrom(axhashmap *h, KeyValue kv, uint64_t index, uint64_t kvProbes) {
+    KeyValue *placed = NULL;
     KeyValue *selection = &h->table[index];
+    for (; !isEmpty(selection); ++kvProbes) {
+        const uint64_t selectionProbes = displacement(selection, index, h->tableSize);
+        if (kvProbes > selectionProbes) {
+            setDisplacement(&kv, kvProbes);
+            KeyValue tmp = *selection;
+            *selection = kv;
+            kv = tmp;
+            kvProbes = selectionProbes;
+            setControl(h, index, controlByte(selection->hash));
+            placed = placed ? placed : selection;
+        }
 
-    for (uint64_t kvProbes = 0; !isEmpty(selection); ++kvProbes) {
-        if (matches(h, selection, &kv))
-            return selection;
-
-        uint64_t selectionIndex = computeIndex(selection->hash, h->tableSize);
-        if (kvProbes > probeLength(selectionIndex, index, h->tableSize))
-            return NULL;
-        
         index = mod1(index + 1, h->tableSize);
         selection = &h->table[index];
     }
+    setDisplacement(&kv, kvProbes);
+    *selection = kv;
+    setControl(h, index, controlByte(kv.hash));
+    ++h->size;
+    return placed ? placed : selection;
+}
 
-    return NULL;
+/* Find the slot of the mapping of key, creating it with a NULL value if it does not exist. The probe sequence is walked
+   once, since the walk ends either at the mapping or where a new one belongs. Only if the map has to grow first is the
+   walk repeated in the new table. */
+static int getOrInsert(axhashmap *h, void *key, KeyValue **slot) {
+    if (readOnly(h) || h->valueSpan)
+        return -1;
+    migrate(h, MIGRATE_STEP);
+    KeyValue kv = makeKV(h, hashKey(h, key), key, NULL);
+    COUNT(h, lookups, 1);
+    if (h->oldTable && (*slot = locateOld(h, &kv)))
+        return 1;
+    uint64_t index = homeIndex(&kv, h->tableSize);
+    uint64_t kvProbes = 0;
+    if ((*slot = probe(h, &kv, &index, &kvProbes))) {
+        /* The caller is about to write to the slot. */
+        touch(h, index);
+        return 1;
+    }
+    if (crowded(h)) {
+        if (grow(h))
+            return -1;
+        index = homeIndex(&kv, h->tableSize);
+        kvProbes = 0;
+        probe(h, &kv, &index, &kvProbes);
+    }
+    if (h->arena && ownMapping(h, &kv))
+        return -1;
+    *slot = placeFrom(h, kv, index, kvProbes);
+    COUNT(h, inserts, 1);
+    return 0;
+}
+
+int axh_getOrInsert(axhashmap *h, void *key, void ***value) {
+    KeyValue *slot;
+    const int status = getOrInsert(h, key, &slot);
+    if (status >= 0)
+        *value = &slot->value;
+    return status;
+}
+
+int axh_upsert(axhashmap *h, void *key, void *(*f)(const void *, void *, void *), void *arg) {
+    KeyValue *slot;
+    const int status = getOrInsert(h, key, &slot);
+    if (status >= 0)
+        slot->value = f(keyOf(h, slot), slot->value, arg);
+    return status;
+}
+
+int axh_add(axhashmap *h, void *key) {
+    return axh_map(h, key, key);
 }
 
 bool axh_has(axhashmap *h, void *key) {
     return locate(h, key);
 }
 
+bool axh_hasHashed(axhashmap *h, void *key, uint64_t hash) {
+    return locateHashed(h, key, hash);
+}
+
 void *axh_get(axhashmap *h, void *key) {
     KeyValue *kv = locate(h, key);
-    return kv ? kv->value : NULL;
+    return kv ? valueOf(h, kv) : NULL;
+}
+
+void *axh_getHashed(axhashmap *h, void *key, uint64_t hash) {
+    KeyValue *kv = locateHashed(h, key, hash);
+    return kv ? valueOf(h, kv) : NULL;
 }
 
 bool axh_tryGet(axhashmap *h, void *key, void *value) {
-    KeyValue *kv = locate(h, key);
+    return axh_tryGetHashed(h, key, value, hashKey(h, key));
+}
+
+bool axh_tryGetHashed(axhashmap *h, void *key, void *value, uint64_t hash) {
+    KeyValue *kv = locateHashed(h, key, hash);
     if (kv)
-        *(void **) value = kv->value;
+        *(void **) value = valueOf(h, kv);
     return kv;
 }
 
+/* Hash a batch of keys and prefetch their home slots, then the keys stored there, ahead of probing. */
+static void prepareBatch(axhashmap *h, void **keys, void **values, uint64_t n, KeyValue *kvs) {
+    uint64_t indices[BATCH_WIDTH];
+    for (uint64_t i = 0; i < n; ++i) {
+        kvs[i] = makeKV(h, hashKey(h, keys[i]), keys[i], values ? values[i] : NULL);
+        indices[i] = homeIndex(&kvs[i], h->tableSize);
+        __builtin_prefetch(&h->table[indices[i]]);
+        if (h->meta)
+            __builtin_prefetch(&h->meta[indices[i]]);
+    }
+    if (h->inlineKeys)
+        return;
+    for (uint64_t i = 0; i < n; ++i) {
+        const KeyValue *home = &h->table[indices[i]];
+        if (!((home->hash ^ kvs[i].hash) & ~DIST_MASK))
+            __builtin_prefetch(storedKey(h, home));
+    }
+}
+
+static uint64_t locateMany(axhashmap *h, void **keys, uint64_t n, void **values, bool *found) {
+    KeyValue kvs[BATCH_WIDTH];
+    uint64_t hits = 0;
+    for (uint64_t i = 0; i < n; i += BATCH_WIDTH) {
+        const uint64_t batch = n - i < BATCH_WIDTH ? n - i : BATCH_WIDTH;
+        migrate(h, MIGRATE_STEP);
+        prepareBatch(h, &keys[i], NULL, batch, kvs);
+        for (uint64_t j = 0; j < batch; ++j) {
+            KeyValue *kv = locateKV(h, &kvs[j]);
+            hits += kv != NULL;
+            if (values)
+                values[i + j] = kv ? valueOf(h, kv) : NULL;
+            if (found)
+                found[i + j] = kv;
+        }
+    }
+    return hits;
+}
+
+uint64_t axh_getMany(axhashmap *h, void **keys, uint64_t n, void **values) {
+    return locateMany(h, keys, n, values, NULL);
+}
+
+uint64_t axh_hasMany(axhashmap *h, void **keys, uint64_t n, bool *found) {
+    return locateMany(h, keys, n, NULL, found);
+}
+
+int64_t axh_mapMany(axhashmap *h, void **keys, void **values, uint64_t n) {
+    KeyValue kvs[BATCH_WIDTH];
+    int64_t created = 0;
+    for (uint64_t i = 0; i < n; i += BATCH_WIDTH) {
+        const uint64_t batch = n - i < BATCH_WIDTH ? n - i : BATCH_WIDTH;
+        migrate(h, MIGRATE_STEP);
+        prepareBatch(h, &keys[i], &values[i], batch, kvs);
+        for (uint64_t j = 0; j < batch; ++j) {
+            const int status = insert(h, &kvs[j]);
+            if (status < 0)
+                return -1;
+            created += !status;
+        }
+    }
+    return created;
+}
+
+/* A range of slots of a table, populated or swept by one thread. Entries that would be displaced past the
+   end of the range are set aside and placed by the calling thread once all regions are done. */
+typedef struct Region {
+    axhashmap *h;
+    uint64_t start;
+    uint64_t end;
+    /* Source of a rehash: the old table, scanned from scanStart for at least scanLength slots. */
+    const KeyValue *oldTable;
+    uint64_t oldTableSize;
+    uint64_t scanStart;
+    uint64_t scanLength;
+    /* Source of a build: keys hashed into entries, which are grouped by region. */
+    void **keys;
+    void **values;
+    uint64_t *hashes;
+    uint64_t keyCount;
+    KeyValue *entries;
+    uint64_t *regionCounts;
+    uint64_t regionCount;
+    uint64_t placed;
+    KeyValue *overflow;
+    uint64_t overflowCount;
+    uint64_t overflowCapacity;
+    bool oom;
+    /* Sweep of a parallel foreach or filter: victims of the filter are marked, then each region compacts the slots
+       from its first segment start up to the segment start of the next region that has one. */
+    bool (*f)(const void *, void *, void *);
+    void *arg;
+    atomic_bool *stopped;
+    uint64_t *marks;
+    uint64_t segmentStart;
+    uint64_t segmentEnd;
+    uint64_t removed;
+} Region;
+
+static void overflow(Region *r, const KeyValue *kv) {
+    if (r->overflowCount == r->overflowCapacity) {
+        const uint64_t capacity = r->overflowCapacity ? 2 * r->overflowCapacity : 64;
+        KeyValue *entries = allocate(&r->h->allocator, capacity * sizeof *entries);
+        if (!entries) {
+            r->oom = true;
+            return;
+        }
+        if (r->overflowCount)
+            memcpy(entries, r->overflow, r->overflowCount * sizeof *entries);
+        deallocate(&r->h->allocator, r->overflow);
+        r->overflow = entries;
+        r->overflowCapacity = capacity;
+    }
+    r->overflow[r->overflowCount++] = *kv;
+}
+
+/* Like unsafeMap(), but without leaving the region. Duplicates of mapped keys are dropped. */
+static void placeInRegion(Region *r, KeyValue kv, bool mightMatch) {
+    axhashmap *h = r->h;
+    uint64_t index = homeIndex(&kv, h->tableSize);
+    uint64_t kvProbes = 0;
+    for (; index < r->end && !isEmpty(&h->table[index]); ++index, ++kvProbes) {
+        KeyValue *selection = &h->table[index];
+        if (mightMatch && matches(h, selection, &kv))
+            return;
+        const uint64_t selectionProbes = displacement(selection, index, h->tableSize);
+        if (kvProbes > selectionProbes) {
+            setDisplacement(&kv, kvProbes);
+            KeyValue tmp = *selection;
+            *selection = kv;
+            kv = tmp;
+            kvProbes = selectionProbes;
+            setControl(h, index, controlByte(selection->hash));
+            mightMatch = false;
+        }
+    }
+    if (index == r->end) {
+        overflow(r, &kv);
+        return;
+    }
+    setDisplacement(&kv, kvProbes);
+    h->table[index] = kv;
+    setControl(h, index, controlByte(kv.hash));
+    ++r->placed;
+}
+
+/* x * numerator / denominator, rounded down, without overflow. */
+static uint64_t scale(uint64_t x, uint64_t numerator, uint64_t denominator) {
+    __extension__ typedef unsigned __int128 u128;
+    return (uint64_t) ((u128) x * numerator / denominator);
+}
+
+/* Region i starts at slot ceil(i * tableSize / regions), so the region of a slot is floor(slot * regions / tableSize). */
+static uint64_t regionStart(uint64_t i, uint64_t tableSize, uint64_t regions) {
+    return scale(i, tableSize, regions) + (scale(i, tableSize, regions) * regions < i * tableSize);
+}
+
+static uint64_t regionOf(const Region *r, const KeyValue *kv) {
+    return scale(homeIndex(kv, r->h->tableSize), r->regionCount, r->h->tableSize);
+}
+
+static void *rehashRegion(void *arg) {
+    Region *r = arg;
+    for (uint64_t scanned = 0; scanned < r->oldTableSize; ++scanned) {
+        const KeyValue *kv = &r->oldTable[mod1(r->scanStart + scanned, r->oldTableSize)];
+        if (isEmpty(kv)) {
+            if (scanned >= r->scanLength)
+                break;
+            continue;
+        }
+        const uint64_t index = homeIndex(kv, r->h->tableSize);
+        if (index >= r->start && index < r->end)
+            placeInRegion(r, *kv, false);
+    }
+    return NULL;
+}
+
+/* Hash a slice of the keys and count them per region. */
+static void *hashSlice(void *arg) {
+    Region *r = arg;
+    for (uint64_t i = 0; i < r->regionCount; ++i)
+        r->regionCounts[i] = 0;
+    for (uint64_t i = 0; i < r->keyCount; ++i) {
+        const KeyValue kv = {.hash = r->hashes[i] = hashKey(r->h, r->keys[i])};
+        ++r->regionCounts[regionOf(r, &kv)];
+    }
+    return NULL;
+}
+
+/* Scatter a slice of the keys to the ranges of their regions, which regionCounts now holds the offsets of. */
+static void *scatterSlice(void *arg) {
+    Region *r = arg;
+    for (uint64_t i = 0; i < r->keyCount; ++i) {
+        const KeyValue kv = makeKV(r->h, r->hashes[i], r->keys[i], r->values[i]);
+        r->entries[r->regionCounts[regionOf(r, &kv)]++] = kv;
+    }
+    return NULL;
+}
+
+static void *buildRegion(void *arg) {
+    Region *r = arg;
+    for (uint64_t i = 0; i < r->keyCount; ++i)
+        placeInRegion(r, r->entries[i], true);
+    return NULL;
+}
+
+/* Run job on every region, on threads of their own except for the first, which runs on the calling thread. */
+static void runRegions(void *(*job)(void *), Region *regions, uint64_t count) {
+    pthread_t threads[MAX_THREADS];
+    bool started[MAX_THREADS];
+    for (uint64_t i = 1; i < count; ++i)
+        started[i] = !pthread_create(&threads[i], NULL, job, &regions[i]);
+    job(&regions[0]);
+    for (uint64_t i = 1; i < count; ++i) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            job(&regions[i]);
+    }
+}
+
+static uint64_t regionCount(uint64_t tableSize, unsigned threads) {
+    uint64_t count = tableSize / MIN_REGION;
+    count = threads < count ? threads : count;
+    count = count < MAX_THREADS ? count : MAX_THREADS;
+    return count ? count : 1;
+}
+
+/* Split the table of h into regions. Returns NULL if OOM. */
+static Region *newRegions(axhashmap *h, uint64_t count) {
+    Region *regions = allocateZeroed(&h->allocator, count, sizeof *regions);
+    if (!regions)
+        return NULL;
+    for (uint64_t i = 0; i < count; ++i) {
+        regions[i].h = h;
+        regions[i].start = regionStart(i, h->tableSize, count);
+        regions[i].end = regionStart(i + 1, h->tableSize, count);
+        regions[i].regionCount = count;
+    }
+    return regions;
+}
+
+/* Place all entries set aside by the regions, then free the regions. Returns true if OOM. */
+static bool finishRegions(axhashmap *h, Region *regions, uint64_t count, bool mightMatch) {
+    bool oom = false;
+    for (uint64_t i = 0; i < count; ++i) {
+        h->size += regions[i].placed;
+        oom |= regions[i].oom;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        for (uint64_t j = 0; j < regions[i].overflowCount && !oom; ++j)
+            unsafeMap(h, &regions[i].overflow[j], mightMatch, false);
+        deallocate(&h->allocator, regions[i].overflow);
+    }
+    deallocate(&h->allocator, regions);
+    return oom;
+}
+
+bool axh_rehashParallel(axhashmap *h, uint64_t tableSize, unsigned threads) {
+    if (readOnly(h))
+        return true;
+    finishMigration(h);
+    if (h->meta && tableSize < GROUP_WIDTH)
+        tableSize = GROUP_WIDTH;
+    if (tableSize < h->size)
+        return true;
+    const uint64_t count = regionCount(tableSize, threads);
+    if (count == 1)
+        return axh_rehash(h, tableSize);
+
+    axhashmap h2 = *h;
+    if (allocTable(h, &h2, tableSize, h->meta))
+        return true;
+    h2.size = 0;
+    Region *regions = newRegions(&h2, count);
+    if (!regions) {
+        deallocate(&h->allocator, h2.table);
+        deallocate(&h->allocator, h2.meta);
+        return true;
+    }
+    /* The mappings of a region stem from the old slots between the images of the region's bounds, and from the rest
+       of the cluster running past the upper one. */
+    for (uint64_t i = 0; i < count; ++i) {
+        Region *r = &regions[i];
+        r->oldTable = h->table;
+        r->oldTableSize = h->tableSize;
+        r->scanStart = scale(r->start, h->tableSize, tableSize);
+        r->scanLength = scale(r->end, h->tableSize, tableSize) - r->scanStart + 1;
+    }
+    runRegions(rehashRegion, regions, count);
+    if (finishRegions(&h2, regions, count, false)) {
+        deallocate(&h->allocator, h2.table);
+        deallocate(&h->allocator, h2.meta);
+        return true;
+    }
+    installTable(h, &h2);
+    ++h->rehashes;
+    return false;
+}
+
+/* Table size the map grows to by its growth policy to hold the given number of additional mappings without growing. */
+static uint64_t tableSizeFor(axhashmap *h, uint64_t additional) {
+    uint64_t tableSize = h->tableSize;
+    while ((uint64_t) ((double) tableSize * h->loadFactor) <= h->size + additional && tableSize <= UINT64_MAX / 4)
+        tableSize = grownSize(h, tableSize);
+    return tableSize;
+}
+
+/* Empty the current table without destroying its mappings. */
+static void emptyTable(axhashmap *h) {
+    h->size = 0;
+    memset(h->table, 0, h->tableSize * sizeof *h->table);
+    for (uint64_t i = 0; h->shared && i < (h->shared->blockCount + 63) / 64; ++i)
+        h->shared->dirty[i] = UINT64_MAX;
+    if (h->meta)
+        memset(h->meta, CONTROL_EMPTY, h->tableSize + GROUP_WIDTH);
+}
+
+int64_t axh_buildFrom(axhashmap *h, void **keys, void **values, uint64_t n, unsigned threads) {
+    if (readOnly(h))
+        return -1;
+    finishMigration(h);
+    const uint64_t tableSize = tableSizeFor(h, n);
+    if (tableSize != h->tableSize && axh_rehashParallel(h, tableSize, threads))
+        return -1;
+    /* Regions push entries out past their end, which must not lose mappings that exist already if OOM strikes. */
+    const uint64_t count = regionCount(h->tableSize, threads);
+    if (count == 1 || h->size || h->arena)
+        return axh_mapMany(h, keys, values, n);
+
+    Region *regions = newRegions(h, count);
+    KeyValue *entries = allocate(&h->allocator, n * sizeof *entries);
+    uint64_t *hashes = allocate(&h->allocator, n * sizeof *hashes);
+    uint64_t *regionCounts = allocate(&h->allocator, count * count * sizeof *regionCounts);
+    if (!regions || !entries || !hashes || !regionCounts) {
+        deallocate(&h->allocator, regions);
+        deallocate(&h->allocator, entries);
+        deallocate(&h->allocator, hashes);
+        deallocate(&h->allocator, regionCounts);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+        Region *r = &regions[i];
+        const uint64_t first = n * i / count;
+        r->keys = &keys[first];
+        r->values = &values[first];
+        r->hashes = &hashes[first];
+        r->keyCount = n * (i + 1) / count - first;
+        r->entries = entries;
+        r->regionCounts = &regionCounts[i * count];
+    }
+    runRegions(hashSlice, regions, count);
+    /* Turn the counts of each slice per region into the offsets at which the slice scatters its keys, so that every
+       region receives its keys in their original order. */
+    uint64_t offset = 0;
+    for (uint64_t region = 0; region < count; ++region) {
+        for (uint64_t slice = 0; slice < count; ++slice) {
+            const uint64_t sliceCount = regionCounts[slice * count + region];
+            regionCounts[slice * count + region] = offset;
+            offset += sliceCount;
+        }
+    }
+    runRegions(scatterSlice, regions, count);
+    for (uint64_t i = 0; i < count; ++i) {
+        /* After scattering, the last slice's offsets mark the end of each region's keys. */
+        const uint64_t first = i ? regionCounts[(count - 1) * count + i - 1] : 0;
+        regions[i].entries = &entries[first];
+        regions[i].keyCount = regionCounts[(count - 1) * count + i] - first;
+    }
+
+    runRegions(buildRegion, regions, count);
+    const bool oom = finishRegions(h, regions, count, true);
+    deallocate(&h->allocator, entries);
+    deallocate(&h->allocator, hashes);
+    deallocate(&h->allocator, regionCounts);
+    /* The map was empty, so it is simply emptied again rather than left with only some of the keys. */
+    if (oom) {
+        emptyTable(h);
+        return -1;
+    }
+    return (int64_t) h->size;
+}
+
+/* Stable sort of entries by home index, least significant digit first. The buffer must hold n entries. */
+static void sortByHome(KeyValue *entries, KeyValue *buffer, uint64_t n, uint64_t tableSize) {
+    KeyValue *from = entries, *to = buffer;
+    for (uint64_t shift = 0; shift < 64 && (tableSize - 1) >> shift; shift += RADIX_BITS) {
+        uint64_t offsets[1 << RADIX_BITS] = {0};
+        for (uint64_t i = 0; i < n; ++i)
+            ++offsets[homeIndex(&from[i], tableSize) >> shift & ((1 << RADIX_BITS) - 1)];
+        for (uint64_t digit = 0, offset = 0; digit < 1 << RADIX_BITS; ++digit) {
+            const uint64_t count = offsets[digit];
+            offsets[digit] = offset;
+            offset += count;
+        }
+        for (uint64_t i = 0; i < n; ++i)
+            to[offsets[homeIndex(&from[i], tableSize) >> shift & ((1 << RADIX_BITS) - 1)]++] = from[i];
+        KeyValue *tmp = from;
+        from = to;
+        to = tmp;
+    }
+    if (from != entries)
+        memcpy(entries, from, n * sizeof *entries);
+}
+
+/* State of merging mappings ordered by home index into an empty table. */
+typedef struct Merge {
+    axhashmap *h;
+    uint64_t position;
+    uint64_t groupStart;
+    uint64_t groupHome;
+    KeyValue *overflow;
+    uint64_t overflowCount;
+    uint64_t overflowCapacity;
+} Merge;
+
+/* Entries running past the end of the table are set aside, to be wrapped around once the merge is done. */
+static bool mergeOverflow(Merge *m, const KeyValue *kv) {
+    if (m->overflowCount == m->overflowCapacity) {
+        const uint64_t capacity = m->overflowCapacity ? 2 * m->overflowCapacity : 64;
+        KeyValue *overflow = allocate(&m->h->allocator, capacity * sizeof *overflow);
+        if (!overflow)
+            return true;
+        if (m->overflowCount)
+            memcpy(overflow, m->overflow, m->overflowCount * sizeof *overflow);
+        deallocate(&m->h->allocator, m->overflow);
+        m->overflow = overflow;
+        m->overflowCapacity = capacity;
+    }
+    m->overflow[m->overflowCount++] = *kv;
+    return false;
+}
+
+/* Place kv in the next free slot at or after its home. Mappings of the same home end up next to each other, so
+   only those have to be searched for an equal key. Returns true if OOM. */
+static bool mergeEntry(Merge *m, KeyValue kv, bool mightMatch) {
+    const uint64_t home = homeIndex(&kv, m->h->tableSize);
+    if (home != m->groupHome) {
+        m->groupHome = home;
+        m->position = m->position > home ? m->position : home;
+        m->groupStart = m->position;
+    }
+    if (m->position >= m->h->tableSize)
+        return mergeOverflow(m, &kv);
+    for (uint64_t i = m->groupStart; mightMatch && i < m->position; ++i) {
+        if (matches(m->h, &m->h->table[i], &kv))
+            return false;
+    }
+    setDisplacement(&kv, m->position - home);
+    m->h->table[m->position] = kv;
+    setControl(m->h, m->position, controlByte(kv.hash));
+    ++m->h->size;
+    ++m->position;
+    return false;
+}
+
+int64_t axh_mapBulk(axhashmap *h, void **keys, void **values, uint64_t n) {
+    if (readOnly(h))
+        return -1;
+    finishMigration(h);
+    if (h->arena || !n)
+        return axh_mapMany(h, keys, values, n);
+    const uint64_t tableSize = tableSizeFor(h, n);
+    /* Mappings of the same home in a smaller table need not be ordered by their homes in the grown one, so when the
+       table grows they are sorted along with the new keys, ahead of them so that they win against equal keys. */
+    const bool grows = tableSize != h->tableSize;
+    const uint64_t moved = grows ? h->size : 0;
+    const uint64_t slots = grows ? 0 : tableSize;
+
+    axhashmap h2 = *h;
+    KeyValue *entries = allocate(&h->allocator, (moved + n) * sizeof *entries);
+    KeyValue *buffer = allocate(&h->allocator, (moved + n) * sizeof *buffer);
+    if (!entries || !buffer || allocTable(h, &h2, tableSize, h->meta)) {
+        deallocate(&h->allocator, entries);
+        deallocate(&h->allocator, buffer);
+        return -1;
+    }
+    for (uint64_t i = 0, mapped = 0; mapped < moved; ++i) {
+        if (!isEmpty(&h->table[i]))
+            entries[mapped++] = h->table[i];
+    }
+    for (uint64_t i = 0; i < n; ++i)
+        entries[moved + i] = makeKV(h, hashKey(h, keys[i]), keys[i], values[i]);
+    n += moved;
+    sortByHome(entries, buffer, n, tableSize);
+    deallocate(&h->allocator, buffer);
+
+    /* Otherwise the mappings of the table are ordered by home index as well, except for those at its start that
+       wrapped around the end, which come last. */
+    uint64_t start = 0;
+    while (start < slots && !isEmpty(&h->table[start]) && displacement(&h->table[start], start, tableSize) > start)
+        ++start;
+    Merge m = {&h2, 0, 0, UINT64_MAX, NULL, 0, 0};
+    h2.size = 0;
+    bool oom = false;
+    uint64_t scanned = 0, next = 0;
+    while (!oom && (scanned < slots || next < n)) {
+        const KeyValue *old = scanned < slots ? &h->table[mod1(start + scanned, tableSize)] : NULL;
+        if (old && isEmpty(old)) {
+            ++scanned;
+        } else if (old && (next == n || homeIndex(old, tableSize) <= homeIndex(&entries[next], tableSize))) {
+            oom = mergeEntry(&m, *old, false);
+            ++scanned;
+        } else {
+            oom = mergeEntry(&m, entries[next++], true);
+        }
+    }
+    for (uint64_t i = 0; !oom && i < m.overflowCount; ++i)
+        unsafeMap(&h2, &m.overflow[i], true, false);
+    deallocate(&h->allocator, m.overflow);
+    deallocate(&h->allocator, entries);
+    if (oom) {
+        deallocate(&h->allocator, h2.table);
+        deallocate(&h->allocator, h2.meta);
+        return -1;
+    }
+
+    const uint64_t created = h2.size - h->size;
+    installTable(h, &h2);
+    h->size = h2.size;
+    h->rehashes += grows;
+    return (int64_t) created;
+}
+
 static void unsafeUnmap(axhashmap *h, KeyValue *selection) {
     uint64_t index = selection - h->table;
     KeyValue *prior = selection;
     selection = nextKV(h, selection);
 
     if (h->destroy)
-        h->destroy(prior->key, prior->value);
+        h->destroy(keyOf(h, prior), prior->value);
+    if (h->arena)
+        releaseMapping(h, prior);
     while (!isEmpty(selection)) {
         const uint64_t nextIndex = mod1(index + 1, h->tableSize);
-        if (probeLength(computeIndex(selection->hash, h->tableSize), nextIndex, h->tableSize) == 0)
+        const uint64_t selectionProbes = displacement(selection, nextIndex, h->tableSize);
+        if (selectionProbes == 0)
             break;
 
         *prior = *selection;
+        setDisplacement(prior, selectionProbes - 1);
+        setControl(h, index, controlByte(prior->hash));
         prior = selection;
         selection = nextKV(h, selection);
         index = nextIndex;
     }
     *prior = (KeyValue) {0};
+    setControl(h, index, CONTROL_EMPTY);
     --h->size;
 }
 
-bool axh_unmap(axhashmap *h, void *key) {
-    KeyValue *selection = locate(h, key);
-    if (selection)
+/* Like unsafeUnmap(), but the mapping may reside in either table. */
+static void unsafeUnmapAny(axhashmap *h, KeyValue *selection) {
+    if (!inOldTable(h, selection)) {
         unsafeUnmap(h, selection);
-    return selection;
+        return;
+    }
+    axhashmap old = tableView(h, true);
+    unsafeUnmap(&old, selection);
+    --h->size;
+    if (!--h->oldSize)
+        endMigration(h);
 }
 
-axhashmap *axh_filter(axhashmap *h, bool (*f)(const void *, void *, void *), void *arg) {
-    KeyValue *kv = h->table;
-    for (uint64_t passed = 0; passed < h->size; ++kv) {
-        const bool alive = !isEmpty(kv);
-        passed += alive;
-        if (alive && f(kv->key, kv->value, arg))
-            unsafeUnmap(h, kv);
+bool axh_unmap(axhashmap *h, void *key) {
+    return axh_unmapHashed(h, key, hashKey(h, key));
+}
+
+bool axh_unmapHashed(axhashmap *h, void *key, uint64_t hash) {
+    if (readOnly(h))
+        return false;
+    KeyValue *selection = locateHashed(h, key, hash);
+    if (!selection)
+        return false;
+    unsafeUnmapAny(h, selection);
+    if (h->shrinkFactor)
+        shrink(h);
+    return true;
+}
+
+/* Index of the first occupied slot in [index, end), or end if there is none. Control bytes allow skipping whole
+   groups of empty slots at once. */
+static uint64_t nextOccupied(axhashmap *h, uint64_t index, uint64_t end) {
+    if (!h->meta) {
+        while (index < end && isEmpty(&h->table[index]))
+            ++index;
+        return index;
+    }
+    for (; index < end; index += GROUP_WIDTH) {
+        const uint32_t empty = matchGroup(&h->meta[index], CONTROL_EMPTY);
+        const uint32_t occupied = ~empty & (uint32_t) ((UINT64_C(1) << GROUP_WIDTH) - 1);
+        if (occupied)
+            return index + __builtin_ctz(occupied) < end ? index + __builtin_ctz(occupied) : end;
     }
+    return end;
+}
+
+static bool isMarked(const uint64_t *marks, uint64_t index) {
+    return marks[index / 64] >> index % 64 & 1;
+}
+
+static void mark(uint64_t *marks, uint64_t index) {
+    marks[index / 64] |= UINT64_C(1) << index % 64;
+}
+
+/* Mappings never move back past a slot that is empty or holds a mapping at its home, so the table splits into segments
+   at such slots, which can be compacted independently of each other. */
+static bool startsSegment(axhashmap *h, uint64_t index) {
+    return isEmpty(&h->table[index]) || !displacement(&h->table[index], index, h->tableSize);
+}
+
+/* The first slot that starts a segment, or tableSize if there is none. */
+static uint64_t firstSegment(axhashmap *h) {
+    uint64_t index = 0;
+    while (index < h->tableSize && !startsSegment(h, index))
+        ++index;
+    return index;
+}
+
+static void moveSlot(axhashmap *h, uint64_t from, uint64_t to, uint64_t dist) {
+    h->table[to] = h->table[from];
+    setDisplacement(&h->table[to], dist);
+    setControl(h, to, controlByte(h->table[to].hash));
+    h->table[from] = (KeyValue) {0};
+    setControl(h, from, CONTROL_EMPTY);
+}
+
+/* Unmap the mappings in the slots begin to end - 1, counted from begin onwards past the end of the table, that are
+   marked or, without marks, for which f returns true, and move every remaining mapping as close to its home as the
+   mappings before it allow. Slots are counted such that homes are never less than begin - tableSize. Unless begin
+   starts a segment, the range has to span the whole table, in which case the mappings at its start may move back past
+   it into slots freed at its end afterwards. Returns the number of unmapped mappings. */
+static uint64_t compact(axhashmap *h, const uint64_t *marks, bool (*f)(const void *, void *, void *), void *arg,
+                        uint64_t begin, uint64_t end) {
+    uint64_t index = begin % h->tableSize;
+    uint64_t write = begin;
+    uint64_t removed = 0;
+    for (uint64_t slot = begin; slot < end; ++slot, index = mod1(index + 1, h->tableSize)) {
+        KeyValue *kv = &h->table[index];
+        if (isEmpty(kv))
+            continue;
+        if (marks ? isMarked(marks, index) : f(keyOf(h, kv), kv->value, arg)) {
+            if (h->destroy)
+                h->destroy(keyOf(h, kv), kv->value);
+            if (h->arena)
+                releaseMapping(h, kv);
+            *kv = (KeyValue) {0};
+            setControl(h, index, CONTROL_EMPTY);
+            ++removed;
+            continue;
+        }
+        const uint64_t home = slot - displacement(kv, index, h->tableSize);
+        const uint64_t to = home > write ? home : write;
+        if (to < slot)
+            moveSlot(h, index, to % h->tableSize, to - home);
+        write = to + 1;
+    }
+    /* Only remaining mappings are left, so they are not examined again. */
+    for (uint64_t slot = end; end - begin == h->tableSize; ++slot, index = mod1(index + 1, h->tableSize)) {
+        KeyValue *kv = &h->table[index];
+        if (isEmpty(kv))
+            break;
+        const uint64_t home = slot - displacement(kv, index, h->tableSize);
+        const uint64_t to = home > write ? home : write;
+        if (to == slot)
+            break;
+        moveSlot(h, index, to % h->tableSize, to - home);
+        write = to + 1;
+    }
+    return removed;
+}
+
+
+/* First marked slot from begin up to but excluding end, counted past the end of the table, or end if there is none. */
+static uint64_t nextMarked(axhashmap *h, const uint64_t *marks, uint64_t begin, uint64_t end) {
+    while (begin < end) {
+        const uint64_t index = begin % h->tableSize;
+        const uint64_t word = marks[index / 64] >> index % 64;
+        if (word)
+            return begin + __builtin_ctzll(word) < end ? begin + __builtin_ctzll(word) : end;
+        /* Bits past the end of the table are never set, so the rest of the last word may be skipped. */
+        begin += index / 64 == (h->tableSize - 1) / 64 ? h->tableSize - index : 64 - index % 64;
+    }
+    return end;
+}
+
+/* Unmap all marked mappings, compacting only the segments that contain any of them. Returns the number of unmapped
+   mappings. */
+static uint64_t compactMarked(axhashmap *h, const uint64_t *marks) {
+    const uint64_t first = firstSegment(h);
+    if (first == h->tableSize)
+        return compact(h, marks, NULL, NULL, h->tableSize, 2 * h->tableSize);
+
+    const uint64_t last = first + h->tableSize;
+    uint64_t removed = 0;
+    for (uint64_t done = first, slot; (slot = nextMarked(h, marks, done, last)) < last;) {
+        uint64_t begin = slot;
+        while (!startsSegment(h, mod1(begin, h->tableSize)))
+            --begin;
+        uint64_t end = slot + 1;
+        while (end < last && !startsSegment(h, mod1(end, h->tableSize)))
+            ++end;
+        removed += compact(h, marks, NULL, NULL, begin, end);
+        done = end;
+    }
+    return removed;
+}
+
+uint64_t axh_unmapMany(axhashmap *h, void **keys, uint64_t n) {
+    if (readOnly(h))
+        return 0;
+    finishMigration(h);
+    /* Few keys are cheaper to unmap one by one than to sweep the marks of the whole table. */
+    uint64_t *marks = n >= h->tableSize / 64
+                      ? allocateZeroed(&h->allocator, (h->tableSize + 63) / 64, sizeof *marks)
+                      : NULL;
+    if (!marks) {
+        uint64_t unmapped = 0;
+        for (uint64_t i = 0; i < n; ++i)
+            unmapped += axh_unmap(h, keys[i]);
+        return unmapped;
+    }
+
+    KeyValue kvs[BATCH_WIDTH];
+    for (uint64_t i = 0; i < n; i += BATCH_WIDTH) {
+        const uint64_t batch = n - i < BATCH_WIDTH ? n - i : BATCH_WIDTH;
+        prepareBatch(h, &keys[i], NULL, batch, kvs);
+        for (uint64_t j = 0; j < batch; ++j) {
+            KeyValue *kv = locateKV(h, &kvs[j]);
+            if (kv)
+                mark(marks, kv - h->table);
+        }
+    }
+    const uint64_t unmapped = compactMarked(h, marks);
+    h->size -= unmapped;
+    deallocate(&h->allocator, marks);
+    if (h->shrinkFactor)
+        shrink(h);
+    return unmapped;
+}
+
+/* Unmapped mappings are replaced by moving the remaining ones back during the same pass, so that no mapping is moved
+   more than once, however many are unmapped. */
+static void filterTable(axhashmap *h, bool (*f)(const void *, void *, void *), void *arg) {
+    const uint64_t begin = firstSegment(h);
+    h->size -= compact(h, NULL, f, arg, begin, begin + h->tableSize);
+}
+
+axhashmap *axh_filter(axhashmap *h, bool (*f)(const void *, void *, void *), void *arg) {
+    if (readOnly(h))
+        return h;
+    /* Compacting the old table would move mappings back into the slots already migrated, where lookups miss them. */
+    finishMigration(h);
+    filterTable(h, f, arg);
+    if (h->shrinkFactor)
+        shrink(h);
     return h;
 }
 
+/* Returns false iff f stopped the loop. */
+static bool foreachTable(axhashmap *h, bool (*f)(const void *, void *, void *), void *arg) {
+    for (uint64_t index = nextOccupied(h, 0, h->tableSize); index < h->tableSize;
+         index = nextOccupied(h, index + 1, h->tableSize)) {
+        KeyValue *kv = &h->table[index];
+        if (!f(keyOf(h, kv), valueOf(h, kv), arg))
+            return false;
+    }
+    return true;
+}
+
 axhashmap *axh_foreach(axhashmap *h, bool (*f)(const void *, void *, void *), void *arg) {
-    KeyValue *kv = h->table;
-    for (uint64_t passed = 0; passed < h->size; ++kv) {
-        const bool alive = !isEmpty(kv);
-        passed += alive;
-        if (alive && !f(kv->key, kv->value, arg))
-            return h;
+    axhashmap old = tableView(h, true);
+    if (h->oldTable && !foreachTable(&old, f, arg))
+        return h;
+    axhashmap current = tableView(h, false);
+    foreachTable(&current, f, arg);
+    return h;
+}
+
+uint64_t axh_foreachRange(axhashmap *h, uint64_t begin, uint64_t end, bool (*f)(const void *, void *, void *),
+                          void *arg) {
+    finishMigration(h);
+    if (end > h->tableSize)
+        end = h->tableSize;
+    for (uint64_t index = nextOccupied(h, begin, end); index < end; index = nextOccupied(h, index + 1, end)) {
+        KeyValue *kv = &h->table[index];
+        if (!f(keyOf(h, kv), valueOf(h, kv), arg))
+            return index + 1;
+    }
+    return end;
+}
+
+axhiter axh_iterBegin(axhashmap *h) {
+    finishMigration(h);
+    return (axhiter) {0, h->tableSize, NULL, NULL};
+}
+
+bool axh_iterNext(axhashmap *h, axhiter *it) {
+    const uint64_t end = it->end < h->tableSize ? it->end : h->tableSize;
+    const uint64_t index = nextOccupied(h, it->slot, end);
+    if (index >= end) {
+        it->slot = end;
+        return false;
     }
+    KeyValue *kv = &h->table[index];
+    it->slot = index + 1;
+    it->key = keyOf(h, kv);
+    it->value = valueOf(h, kv);
+    return true;
+}
+
+static void *foreachRegion(void *arg) {
+    Region *r = arg;
+    axhashmap *h = r->h;
+    for (uint64_t index = nextOccupied(h, r->start, r->end); index < r->end; index = nextOccupied(h, index + 1, r->end)) {
+        KeyValue *kv = &h->table[index];
+        if (atomic_load_explicit(r->stopped, memory_order_relaxed))
+            break;
+        if (!r->f(keyOf(h, kv), valueOf(h, kv), r->arg))
+            atomic_store_explicit(r->stopped, true, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void *markRegion(void *arg) {
+    Region *r = arg;
+    axhashmap *h = r->h;
+    r->segmentStart = r->start;
+    while (r->segmentStart < r->end && !startsSegment(h, r->segmentStart))
+        ++r->segmentStart;
+    for (uint64_t index = nextOccupied(h, r->start, r->end); index < r->end; index = nextOccupied(h, index + 1, r->end)) {
+        KeyValue *kv = &h->table[index];
+        if (r->f(keyOf(h, kv), kv->value, r->arg))
+            mark(r->marks, index);
+    }
+    return NULL;
+}
+
+static void *compactRegion(void *arg) {
+    Region *r = arg;
+    r->removed = compact(r->h, r->marks, NULL, NULL, r->segmentStart, r->segmentEnd);
+    return NULL;
+}
+
+/* Split the table of h into regions of whole words of marks. Returns NULL if OOM. */
+static Region *newSweep(axhashmap *h, uint64_t count, bool (*f)(const void *, void *, void *), void *arg) {
+    Region *regions = newRegions(h, count);
+    if (!regions)
+        return NULL;
+    const uint64_t words = (h->tableSize + 63) / 64;
+    for (uint64_t i = 0; i < count; ++i) {
+        regions[i].start = regionStart(i, words, count) * 64;
+        regions[i].end = regionStart(i + 1, words, count) * 64;
+        regions[i].start = regions[i].start < h->tableSize ? regions[i].start : h->tableSize;
+        regions[i].end = regions[i].end < h->tableSize ? regions[i].end : h->tableSize;
+        regions[i].f = f;
+        regions[i].arg = arg;
+    }
+    return regions;
+}
+
+axhashmap *axh_foreachParallel(axhashmap *h, bool (*f)(const void *, void *, void *), void *arg, unsigned threads) {
+    finishMigration(h);
+    const uint64_t count = regionCount(h->tableSize, threads);
+    Region *regions = count > 1 ? newSweep(h, count, f, arg) : NULL;
+    if (!regions)
+        return axh_foreach(h, f, arg);
+    atomic_bool stopped = false;
+    for (uint64_t i = 0; i < count; ++i)
+        regions[i].stopped = &stopped;
+    runRegions(foreachRegion, regions, count);
+    deallocate(&h->allocator, regions);
     return h;
 }
 
-axhashmap *axh_clear(axhashmap *h) {
-    KeyValue *kv = h->table;
-    if (h->destroy) {
-        for (uint64_t unmapped = 0; unmapped < h->size; *kv++ = (KeyValue) {0}) {
-            if (!isEmpty(kv)) {
-                h->destroy(kv->key, kv->value);
-                ++unmapped;
+axhashmap *axh_filterParallel(axhashmap *h, bool (*f)(const void *, void *, void *), void *arg, unsigned threads) {
+    if (readOnly(h))
+        return h;
+    finishMigration(h);
+    const uint64_t count = regionCount(h->tableSize, threads);
+    uint64_t *marks = count > 1 ? allocateZeroed(&h->allocator, (h->tableSize + 63) / 64, sizeof *marks) : NULL;
+    Region *regions = marks ? newSweep(h, count, f, arg) : NULL;
+    if (!regions) {
+        deallocate(&h->allocator, marks);
+        return axh_filter(h, f, arg);
+    }
+    for (uint64_t i = 0; i < count; ++i)
+        regions[i].marks = marks;
+    runRegions(markRegion, regions, count);
+
+    /* A region without a segment start of its own is compacted along with the region before it. */
+    uint64_t next = h->tableSize;
+    for (uint64_t i = count; i--;) {
+        if (regions[i].segmentStart == regions[i].end) {
+            regions[i].segmentStart = regions[i].segmentEnd = 0;
+        } else {
+            regions[i].segmentEnd = next;
+            next = regions[i].segmentStart;
+        }
+    }
+    if (next == h->tableSize) {
+        /* Not a single segment start, so the whole table is one cluster. */
+        h->size -= compactMarked(h, marks);
+    } else {
+        for (uint64_t i = count; i--;) {
+            if (regions[i].segmentEnd == h->tableSize) {
+                regions[i].segmentEnd = next + h->tableSize;
+                break;
             }
         }
+        /* Arenas are not thread-safe, so mappings are released by a single thread. */
+        if (h->arena) {
+            for (uint64_t i = 0; i < count; ++i)
+                compactRegion(&regions[i]);
+        } else {
+            runRegions(compactRegion, regions, count);
+        }
+        for (uint64_t i = 0; i < count; ++i)
+            h->size -= regions[i].removed;
     }
-    h->size = 0;
-    memset(kv, 0, (&h->table[h->tableSize] - kv) * sizeof *h->table);
+    deallocate(&h->allocator, regions);
+    deallocate(&h->allocator, marks);
+    if (h->shrinkFactor)
+        shrink(h);
     return h;
 }
 
+/* Whether two maps hash keys alike, so that the hashes stored by one are valid in the other. */
+static bool hashesAlike(axhashmap *a, axhashmap *b) {
+    return a->staticSpan == b->staticSpan && (a->staticSpan || a->toHash == b->toHash);
+}
+
+/* The mapping of the slot kv of h, prepared for a lookup in or insertion into h2. Its stored hash is reused if the two
+   maps hash alike. */
+static KeyValue foreignKV(axhashmap *h, KeyValue *kv, axhashmap *h2) {
+    void *key = keyOf(h, kv);
+    const uint64_t hash = hashesAlike(h, h2) ? kv->hash & ~DIST_MASK : hashKey(h2, key);
+    return makeKV(h2, hash, key, valueOf(h, kv));
+}
+
+/* Replace the value of a mapping, copying it into the arena if the map owns its values. Returns true if OOM. */
+static bool assignValue(axhashmap *h, KeyValue *kv, void *value) {
+    if (!h->valueSpan || value == kv->value) {
+        kv->value = value;
+        return false;
+    }
+    void *copy = value ? arenaAlloc(h->arena, h->valueSpan) : NULL;
+    if (value && !copy)
+        return true;
+    if (value)
+        memcpy(copy, value, h->valueSpan);
+    if (kv->value)
+        arenaFree(h->arena, kv->value, h->valueSpan);
+    kv->value = copy;
+    return false;
+}
+
+int64_t axh_merge(axhashmap *h, axhashmap *other, void *(*resolve)(const void *, void *, void *, void *), void *arg) {
+    if (readOnly(h) || (other->inlineKeys && !h->inlineKeys && !h->ownKeys))
+        return -1;
+    finishMigration(h);
+    finishMigration(other);
+    const uint64_t tableSize = tableSizeFor(h, other->size);
+    if (tableSize != h->tableSize && axh_rehash(h, tableSize))
+        return -1;
+
+    /* The home of a mapping grows monotonically with its hash, so visiting the other map in slot order from the start
+       of a cluster also visits this table in slot order, exactly so if both tables are of the same size. */
+    const uint64_t first = other->size ? firstSegment(other) : 0;
+    const uint64_t size = h->size;
+    for (uint64_t slot = first; slot < first + other->tableSize; ++slot) {
+        KeyValue *source = &other->table[slot % other->tableSize];
+        if (isEmpty(source))
+            continue;
+        KeyValue kv = foreignKV(other, source, h);
+        uint64_t index = homeIndex(&kv, h->tableSize);
+        uint64_t kvProbes = 0;
+        KeyValue *selection = probe(h, &kv, &index, &kvProbes);
+        if (selection) {
+            if (!resolve)
+                continue;
+            touch(h, index);
+            if (assignValue(h, selection, resolve(keyOf(h, selection), selection->value, kv.value, arg)))
+                return -1;
+            continue;
+        }
+        if (h->arena && ownMapping(h, &kv))
+            return -1;
+        placeFrom(h, kv, index, kvProbes);
+        COUNT(h, inserts, 1);
+    }
+    return (int64_t) (h->size - size);
+}
+
+/* Unmap the mappings of h whose key is or, unless keepFound, is not mapped in the other map. */
+static bool againstOther(const void *key, void *value, void *arg) {
+    (void) value;
+    void **args = arg;
+    return axh_has(args[0], (void *) key) != *(bool *) args[1];
+}
+
+static uint64_t sweepAgainst(axhashmap *h, axhashmap *other, bool keepFound) {
+    if (readOnly(h))
+        return 0;
+    finishMigration(h);
+    const uint64_t size = h->size;
+    if (h == other) {
+        if (!keepFound)
+            axh_clear(h);
+        return size - h->size;
+    }
+    uint64_t *marks = allocateZeroed(&h->allocator, (h->tableSize + 63) / 64, sizeof *marks);
+    if (!marks) {
+        /* Without marks, every key is hashed anew by the other map. */
+        void *args[] = {other, &keepFound};
+        axh_filter(h, againstOther, args);
+        return size - h->size;
+    }
+    for (uint64_t index = nextOccupied(h, 0, h->tableSize); index < h->tableSize;
+         index = nextOccupied(h, index + 1, h->tableSize)) {
+        const KeyValue kv = foreignKV(h, &h->table[index], other);
+        if ((locateKV(other, &kv) != NULL) != keepFound)
+            mark(marks, index);
+    }
+    h->size -= compactMarked(h, marks);
+    deallocate(&h->allocator, marks);
+    if (h->shrinkFactor)
+        shrink(h);
+    return size - h->size;
+}
+
+uint64_t axh_intersect(axhashmap *h, axhashmap *other) {
+    return sweepAgainst(h, other, true);
+}
+
+uint64_t axh_difference(axhashmap *h, axhashmap *other) {
+    return sweepAgainst(h, other, false);
+}
+
+axhashmap *axh_clear(axhashmap *h) {
+    if (readOnly(h))
+        return h;
+    if (h->oldTable) {
+        axhashmap old = tableView(h, true);
+        destroyMappings(&old);
+        h->size -= h->oldSize;
+        endMigration(h);
+    }
+    destroyMappings(h);
+    if (h->arena)
+        arenaReset(h->arena);
+    emptyTable(h);
+    return h;
+}
+
+/* Give a copied map copies of its own of all keys and values owned by the original. Returns true if OOM. */
+static bool copyArena(axhashmap *h) {
+    if (!(h->arena = newArena(h)))
+        return true;
+    KeyValue *kv = h->table;
+    for (uint64_t copied = 0; copied < h->size; ++kv) {
+        if (isEmpty(kv))
+            continue;
+        if (ownMapping(h, kv)) {
+            /* Forget the mappings that still refer to the original's arena, so they are not freed with the copy. */
+            for (; kv < &h->table[h->tableSize]; ++kv)
+                *kv = (KeyValue) {0};
+            return true;
+        }
+        ++copied;
+    }
+    return false;
+}
+
 axhashmap *axh_copy(axhashmap *h) {
-    axhashmap *h2 = malloc_(sizeof *h2);
-    if (!h2 || !(h2->table = malloc_(h->tableSize * sizeof *h->table))) {
-        free_(h2);
+    if (readOnly(h))
+        return NULL;
+    finishMigration(h);
+    axhashmap *h2 = allocate(&h->allocator, sizeof *h2);
+    if (!h2)
+        return NULL;
+    h2->allocator = h->allocator;
+    h2->hugePages = h->hugePages;
+    if (!(h2->table = allocSlots(h2, h->tableSize, false))) {
+        deallocate(&h->allocator, h2);
         return NULL;
     }
     memcpy(h2->table, h->table, h->tableSize * sizeof *h->table);
+    h2->meta = NULL;
+    if (h->meta && !(h2->meta = allocate(&h->allocator, h->tableSize + GROUP_WIDTH))) {
+        deallocate(&h->allocator, h2->table);
+        deallocate(&h->allocator, h2);
+        return NULL;
+    }
+    if (h->meta)
+        memcpy(h2->meta, h->meta, h->tableSize + GROUP_WIDTH);
+    h2->oldTable = NULL;
+    h2->oldTableSize = 0;
+    h2->oldSize = 0;
+    h2->migrateStart = 0;
+    h2->migrateIndex = 0;
     h2->rehashThreshold = h->rehashThreshold;
     h2->size = h->size;
     h2->tableSize = h->tableSize;
     h2->staticSpan = h->staticSpan;
+    h2->inlineKeys = h->inlineKeys;
     h2->toHash = h->toHash;
     h2->cmp = h->cmp;
     h2->destroy = NULL;
     h2->loadFactor = h->loadFactor;
+    h2->shrinkFactor = h->shrinkFactor;
+    h2->growth = h->growth;
+    h2->incremental = h->incremental;
+    h2->rehashes = 0;
+    h2->lookups = 0;
+    h2->inserts = 0;
+    h2->probes = 0;
+    h2->compares = 0;
+    h2->mapping = NULL;
+    h2->mappingLength = 0;
+    h2->keyBase = 0;
+    h2->valueBase = 0;
+    h2->arena = NULL;
+    h2->shared = NULL;
+    h2->ownKeys = h->ownKeys;
+    h2->valueSpan = h->valueSpan;
+    if (h->arena && copyArena(h2)) {
+        axh_setDestructor(h2, NULL);
+        axh_destroy(h2);
+        return NULL;
+    }
     return h2;
 }
 
+/* Move the table into a new snapshot file and map it privately from there. Returns true if OOM. */
+static bool shareTable(axhashmap *h) {
+    const uint64_t bytes = h->tableSize * sizeof *h->table;
+    uint64_t blockBytes = SNAPSHOT_BLOCK;
+    while ((bytes - 1) / blockBytes >= SNAPSHOT_MAX_BLOCKS)
+        blockBytes *= 2;
+    const uint64_t blockCount = (bytes - 1) / blockBytes + 1;
+    SnapshotFile *f = newSnapshotFile(&h->allocator);
+    SharedTable *s = f ? newShared(f, blockBytes, blockCount, true) : NULL;
+    if (!s)
+        return true;
+    /* Blocks are appended in order, so the table is a single range at the start of the file. */
+    pthread_mutex_lock(&f->lock);
+    for (uint64_t i = 0; i < blockCount && (!i || s->blocks[i - 1]); ++i) {
+        const char *data = (const char *) h->table + i * blockBytes;
+        s->blocks[i] = appendBlock(f, data, blockLength(bytes, i, blockBytes), blockBytes);
+    }
+    pthread_mutex_unlock(&f->lock);
+    KeyValue *table = s->blocks[blockCount - 1]
+                      ? mmap(NULL, blockCount * blockBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, f->fd, 0)
+                      : MAP_FAILED;
+    if (table == MAP_FAILED) {
+        releaseShared(s);
+        return true;
+    }
+    deallocate(&h->allocator, h->table);
+    h->table = table;
+    h->shared = s;
+    return false;
+}
+
+/* Append the blocks written to since they were mapped to the file and map them from there in place of their previous
+   versions, which are left to the snapshots still referring to them. This also drops the private copies of their
+   pages. Returns true if OOM. */
+static bool storeDirty(axhashmap *h) {
+    SharedTable *s = h->shared;
+    SnapshotFile *f = s->file;
+    const uint64_t bytes = h->tableSize * sizeof *h->table;
+    bool failed = false;
+    pthread_mutex_lock(&f->lock);
+    for (uint64_t i = 0; i < s->blockCount && !failed; ++i) {
+        const uint64_t bit = UINT64_C(1) << i % 64;
+        if (!(s->dirty[i / 64] & bit))
+            continue;
+        char *data = (char *) h->table + i * s->blockBytes;
+        SnapshotBlock *block = appendBlock(f, data, blockLength(bytes, i, s->blockBytes), s->blockBytes);
+        if (!block || mmap(data, s->blockBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, f->fd,
+                           (off_t) block->offset) == MAP_FAILED) {
+            if (block)
+                releaseBlock(f, block, s->blockBytes);
+            failed = true;
+            continue;
+        }
+        releaseBlock(f, s->blocks[i], s->blockBytes);
+        s->blocks[i] = block;
+        s->dirty[i / 64] &= ~bit;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return failed;
+}
+
+/* Map the blocks of the map's table read-only into the reserved range of a snapshot, merging runs of consecutive
+   blocks into one mapping each. Returns true if OOM. */
+static bool mapSnapshot(axhashmap *h, SharedTable *shared, char *mapping) {
+    const SharedTable *s = h->shared;
+    pthread_mutex_lock(&s->file->lock);
+    for (uint64_t i = 0; i < s->blockCount; ++i) {
+        shared->blocks[i] = s->blocks[i];
+        ++shared->blocks[i]->refs;
+    }
+    pthread_mutex_unlock(&s->file->lock);
+    for (uint64_t i = 0, run; i < s->blockCount; i += run) {
+        const uint64_t offset = s->blocks[i]->offset;
+        for (run = 1; i + run < s->blockCount && s->blocks[i + run]->offset == offset + run * s->blockBytes; ++run);
+        if (mmap(mapping + i * s->blockBytes, run * s->blockBytes, PROT_READ, MAP_SHARED | MAP_FIXED, s->file->fd,
+                 (off_t) offset) == MAP_FAILED)
+            return true;
+    }
+    return false;
+}
+
+axhashmap *axh_snapshot(axhashmap *h) {
+    if (readOnly(h) || h->arena)
+        return NULL;
+    finishMigration(h);
+    if (!h->shared && shareTable(h))
+        return NULL;
+    const SharedTable *s = h->shared;
+    const uint64_t length = s->blockCount * s->blockBytes;
+    axhashmap *h2 = allocate(&h->allocator, sizeof *h2);
+    SharedTable *shared = h2 ? newShared(s->file, s->blockBytes, s->blockCount, false) : NULL;
+    /* The range of the snapshot is reserved up front, so that its blocks can be mapped into it one run at a time. */
+    char *mapping = shared ? mmap(NULL, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+    if (mapping == MAP_FAILED || storeDirty(h) || mapSnapshot(h, shared, mapping)) {
+        if (mapping != MAP_FAILED)
+            munmap(mapping, length);
+        if (shared)
+            releaseShared(shared);
+        deallocate(&h->allocator, h2);
+        return NULL;
+    }
+    h2->table = (KeyValue *) mapping;
+    h2->meta = NULL;
+    h2->oldTable = NULL;
+    h2->oldTableSize = 0;
+    h2->oldSize = 0;
+    h2->migrateStart = 0;
+    h2->migrateIndex = 0;
+    h2->rehashThreshold = h->tableSize;
+    h2->size = h->size;
+    h2->tableSize = h->tableSize;
+    h2->staticSpan = h->staticSpan;
+    h2->inlineKeys = h->inlineKeys;
+    h2->toHash = h->toHash;
+    h2->cmp = h->cmp;
+    h2->destroy = NULL;
+    h2->loadFactor = h->loadFactor;
+    h2->incremental = false;
+    h2->rehashes = 0;
+    h2->lookups = 0;
+    h2->inserts = 0;
+    h2->probes = 0;
+    h2->compares = 0;
+    h2->mapping = mapping;
+    h2->mappingLength = length;
+    h2->keyBase = 0;
+    h2->valueBase = 0;
+    h2->arena = NULL;
+    h2->ownKeys = false;
+    h2->valueSpan = 0;
+    h2->allocator = h->allocator;
+    h2->hugePages = false;
+    h2->shrinkFactor = 0;
+    h2->growth = doubleSize;
+    h2->shared = shared;
+    return h2;
+}
+
+uint64_t axh_memoryUsage(axhashmap *h) {
+    uint64_t bytes = sizeof *h + (h->tableSize + h->oldTableSize) * sizeof *h->table;
+    if (h->meta)
+        bytes += h->tableSize + GROUP_WIDTH;
+    if (h->arena)
+        bytes += sizeof *h->arena + h->arena->bytes;
+    return bytes;
+}
+
+void axh_stats(axhashmap *h, axhstats *stats) {
+    *stats = (axhstats) {0};
+    for (int old = 0; old < 2; ++old) {
+        axhashmap view = tableView(h, old);
+        if (!view.table)
+            continue;
+        KeyValue *kv = view.table;
+        for (uint64_t index = 0, passed = 0; passed < view.size; ++index, ++kv) {
+            if (isEmpty(kv))
+                continue;
+            const uint64_t probes = displacement(kv, index, view.tableSize);
+            ++stats->probeLengths[probes < AXH_STATS_BUCKETS ? probes : AXH_STATS_BUCKETS - 1];
+            stats->meanProbeLength += (double) probes;
+            if (probes > stats->maxProbeLength)
+                stats->maxProbeLength = probes;
+            ++passed;
+        }
+    }
+    if (h->size)
+        stats->meanProbeLength /= (double) h->size;
+    stats->bytesAllocated = axh_memoryUsage(h);
+    stats->rehashes = h->rehashes;
+    stats->lookups = h->lookups;
+    stats->inserts = h->inserts;
+    stats->probes = h->probes;
+    stats->compares = h->compares;
+}
+
+static uint64_t alignUp(uint64_t n, uint64_t alignment) {
+    return (n + alignment - 1) & ~(alignment - 1);
+}
+
+static bool writePadding(FILE *file, uint64_t length) {
+    static const char zeros[64];
+    return length && fwrite(zeros, 1, length, file) != length;
+}
+
+/* Number of key bytes a saved mapping takes up in the arena. */
+static uint64_t savedKeyLength(axhashmap *h, KeyValue *kv) {
+    return h->inlineKeys ? 0 : keyLength(h, keyOf(h, kv));
+}
+
+bool axh_save(axhashmap *h, const char *path, uint64_t valueSpan) {
+    if (!h->inlineKeys && !h->staticSpan && h->toHash != strToHash)
+        return true;
+    finishMigration(h);
+    /* Written under another name and renamed at last, so that maps opened from an older file remain intact. */
+    char *tempPath = allocate(&h->allocator, strlen(path) + sizeof ".tmp");
+    if (!tempPath)
+        return true;
+    strcat(strcpy(tempPath, path), ".tmp");
+    FILE *file = fopen(tempPath, "wb");
+    if (!file) {
+        deallocate(&h->allocator, tempPath);
+        return true;
+    }
+
+    FileHeader header = {
+        .magic = FILE_MAGIC,
+        .version = FILE_VERSION,
+        .tableSize = h->tableSize,
+        .size = h->size,
+        .staticSpan = h->staticSpan,
+        .valueSpan = valueSpan,
+        .groupWidth = GROUP_WIDTH,
+        .flags = (h->inlineKeys ? FILE_INLINE : 0) | (h->meta ? FILE_META : 0),
+        .loadFactor = h->loadFactor,
+        .tableOffset = alignUp(sizeof header, 64),
+    };
+    header.metaOffset = header.tableOffset + h->tableSize * sizeof *h->table;
+    header.arenaOffset = alignUp(header.metaOffset + (h->meta ? h->tableSize + GROUP_WIDTH : 0), 8);
+
+    bool failed = fwrite(&header, sizeof header, 1, file) != 1
+                  || writePadding(file, header.tableOffset - sizeof header);
+
+    /* Slots refer to the arena by offset. Key and value bytes are laid out in slot order, each 8-byte aligned. */
+    uint64_t offset = header.arenaOffset;
+    for (uint64_t i = 0; i < h->tableSize && !failed; ++i) {
+        KeyValue kv = h->table[i];
+        if (!isEmpty(&kv)) {
+            const uint64_t keyLength = savedKeyLength(h, &h->table[i]);
+            if (keyLength) {
+                kv.key = (void *) (uintptr_t) offset;
+                offset += alignUp(keyLength, 8);
+            }
+            if (valueSpan && valueOf(h, &h->table[i])) {
+                kv.value = (void *) (uintptr_t) offset;
+                offset += alignUp(valueSpan, 8);
+            }
+        }
+        failed = fwrite(&kv, sizeof kv, 1, file) != 1;
+    }
+    if (h->meta && !failed)
+        failed = fwrite(h->meta, 1, h->tableSize + GROUP_WIDTH, file) != h->tableSize + GROUP_WIDTH;
+    if (!failed)
+        failed = writePadding(file, header.arenaOffset - header.metaOffset - (h->meta ? h->tableSize + GROUP_WIDTH : 0));
+
+    for (uint64_t i = 0; i < h->tableSize && !failed; ++i) {
+        KeyValue *kv = &h->table[i];
+        if (isEmpty(kv))
+            continue;
+        const uint64_t keyLength = savedKeyLength(h, kv);
+        if (keyLength) {
+            failed = fwrite(keyOf(h, kv), 1, keyLength, file) != keyLength
+                     || writePadding(file, alignUp(keyLength, 8) - keyLength);
+        }
+        void *value = valueOf(h, kv);
+        if (valueSpan && value && !failed) {
+            failed = fwrite(value, 1, valueSpan, file) != valueSpan
+                     || writePadding(file, alignUp(valueSpan, 8) - valueSpan);
+        }
+    }
+
+    header.fileSize = offset;
+    if (!failed)
+        failed = fseek(file, 0, SEEK_SET) || fwrite(&header, sizeof header, 1, file) != 1;
+    failed |= fclose(file) != 0;
+    failed = failed || rename(tempPath, path);
+    if (failed)
+        remove(tempPath);
+    deallocate(&h->allocator, tempPath);
+    return failed;
+}
+
+/* Whether the header describes a file of this length that this build can read. */
+static bool validHeader(const FileHeader *header, uint64_t length) {
+    const uint64_t metaLength = header->flags & FILE_META ? header->tableSize + header->groupWidth : 0;
+    return header->magic == FILE_MAGIC
+           && header->version == FILE_VERSION
+           && header->fileSize == length
+           && header->tableOffset >= sizeof *header
+           && header->tableOffset <= length
+           && header->tableSize
+           && header->size <= header->tableSize
+           && header->tableSize <= (length - header->tableOffset) / sizeof(KeyValue)
+           && header->metaOffset == header->tableOffset + header->tableSize * sizeof(KeyValue)
+           && header->arenaOffset >= header->metaOffset + metaLength
+           && header->arenaOffset <= length
+           && !(header->flags & FILE_INLINE && (!header->staticSpan || header->staticSpan > sizeof(void *)));
+}
+
+axhashmap *axh_openMapped(const char *path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) || (uint64_t) st.st_size < sizeof(FileHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    const FileHeader *header = mapping;
+    const axhallocator allocator = defaultAllocator();
+    axhashmap *h = validHeader(header, st.st_size) ? allocate(&allocator, sizeof *h) : NULL;
+    if (!h) {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+    h->table = (KeyValue *) ((char *) mapping + header->tableOffset);
+    /* The control bytes are only usable if they mirror at least as many bytes as this build inspects at once. */
+    h->meta = header->flags & FILE_META && header->groupWidth >= GROUP_WIDTH
+              ? (uint8_t *) mapping + header->metaOffset : NULL;
+    h->oldTable = NULL;
+    h->oldTableSize = 0;
+    h->oldSize = 0;
+    h->migrateStart = 0;
+    h->migrateIndex = 0;
+    h->rehashThreshold = header->tableSize;
+    h->size = header->size;
+    h->tableSize = header->tableSize;
+    h->staticSpan = header->staticSpan;
+    h->inlineKeys = header->flags & FILE_INLINE;
+    h->toHash = strToHash;
+    h->cmp = cmpAddresses;
+    h->destroy = NULL;
+    h->loadFactor = header->loadFactor;
+    h->incremental = false;
+    h->rehashes = 0;
+    h->lookups = 0;
+    h->inserts = 0;
+    h->probes = 0;
+    h->compares = 0;
+    h->mapping = mapping;
+    h->mappingLength = st.st_size;
+    h->keyBase = h->inlineKeys ? 0 : (uintptr_t) mapping;
+    h->valueBase = header->valueSpan ? (uintptr_t) mapping : 0;
+    h->arena = NULL;
+    h->ownKeys = false;
+    h->valueSpan = 0;
+    h->allocator = allocator;
+    h->hugePages = false;
+    h->shrinkFactor = 0;
+    h->growth = doubleSize;
+    h->shared = NULL;
+    return h;
+}
+
+bool axh_isMapped(axhashmap *h) {
+    return readOnly(h);
+}
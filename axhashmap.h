@@ -18,6 +18,22 @@
 /* Default load factor. */
 #define AXH_LOADFACTOR (2./3.)
 
+/*
+ * Memory functions of a map along with some context that is passed to each of them. mallocFn, callocFn and freeFn
+ * follow their standard library counterparts. alignedFn follows aligned_alloc() and may be NULL, in which case
+ * tables are allocated by callocFn or mallocFn as well. freeFn must be able to free memory of all other functions.
+ */
+typedef struct axhallocator {
+    void *context;
+    void *(*mallocFn)(void *context, size_t size);
+    void *(*callocFn)(void *context, size_t count, size_t size);
+    void *(*alignedFn)(void *context, size_t alignment, size_t size);
+    void (*freeFn)(void *context, void *p);
+} axhallocator;
+
+/* Number of buckets in the probe length histogram of axhstats. */
+#define AXH_STATS_BUCKETS 16
+
 /*
  * axhashmap is a hashmap library using the Robin-Hood hashing technique with backward shifting and simple
  * linear lookup. The hashing function used is xxhash (XXH3).
@@ -34,6 +50,15 @@
  * the default toHash() behaviour of hashing a C string, since it can still be useful for i.e. UTF-8 strings.
  * Of course, setting both to custom functions renders these points moot.
  *
+ * Maps created with axh_newInline() copy the key bytes into the table itself instead of storing the key pointer.
+ * This requires a static span of at most sizeof(void *) bytes. Keys then need not outlive the call that maps them
+ * and lookups never touch memory outside the table. Wherever the map hands a key back, such as to destructors or
+ * to axh_foreach(), it passes a pointer to the copy in the table, which is only valid for the duration of that call.
+ *
+ * Maps created with axh_newStrings() take pointers to axhstring as keys, which carry the length of a string along
+ * with its bytes. Keys are hashed without scanning for a terminator first, and keys of equal hash are compared by
+ * their length before their bytes are, so long strings are only read once per operation.
+ *
  * axhashmap supports destructors. There is no default destructor. Destructors have type void (*)(void *, void *)
  * with the first parameter being the key and the second being the value. The destructor is passed both in all cases
  * with the sole exception of axh_remap(), in which case only the value is passed and the key is NULL. Make your
@@ -66,6 +91,16 @@
  */
 typedef struct axhashmap axhashmap;
 
+/*
+ * Key of a map created by axh_newStrings(): a string of length bytes starting at data. The bytes need not be
+ * null-terminated and may contain null bytes. Both the key and the bytes it points to must outlive its mapping,
+ * unless the map owns its keys, see axh_setArena().
+ */
+typedef struct axhstring {
+    uint64_t length;
+    const char *data;
+} axhstring;
+
 
 /**
  * Number of mappings in this map.
@@ -86,6 +121,21 @@ uint64_t axh_tableSize(axhashmap *h);
  */
 uint64_t axh_span(axhashmap *h);
 
+/**
+ * Whether this map stores its keys inline, i.e. was created by axh_newInline() or axh_newInlineSized().
+ * @return True iff keys are stored inline.
+ */
+bool axh_isInline(axhashmap *h);
+
+/**
+ * Hash a key the way this map does. The map itself only uses the upper 56 bits of the hash, so the lowest 8 bits
+ * are free to be used by callers, i.e. to distribute keys over several maps without correlating with the slot
+ * positions inside each of them. The hash may be passed to axh_getHashed() and friends to skip hashing the key again.
+ * @param key Key to hash.
+ * @return Hash of the key.
+ */
+uint64_t axh_hash(axhashmap *h, void *key);
+
 /**
  * Set load factor, which must be in range 0.0 to 1.0. Any other value is saturated.
  * This function does not ever automatically rehash. Rehashing happens when it is
@@ -101,6 +151,40 @@ axhashmap *axh_setLoadFactor(axhashmap *h, double lf);
  */
 double axh_getLoadFactor(axhashmap *h);
 
+/**
+ * Set the shrink factor, a low-water mark for the load of the table. Once unmapping mappings by axh_unmap(),
+ * axh_unmapMany(), axh_filter() or axh_filterParallel() leaves the load below it, the table is halved for as long as
+ * the halved table would be loaded to at most half the load factor. This leaves it loaded to between a quarter and half
+ * of the load factor, unless it stops at the minimum of 64 slots first. The shrink factor is capped at a quarter of the
+ * load factor, so that a map whose size hovers around some value is not rehashed over and over. A shrink factor of 0,
+ * which is the default, disables shrinking. Any value outside of 0.0 to 1.0 is saturated.
+ * @param sf Shrink factor from 0.0 to 1.0.
+ * @return Self.
+ */
+axhashmap *axh_setShrinkFactor(axhashmap *h, double sf);
+
+/**
+ * Currently set shrink factor.
+ * @return Shrink factor from 0.0 to 1.0.
+ */
+double axh_getShrinkFactor(axhashmap *h);
+
+/**
+ * Set the growth policy, a function that is passed the current table size whenever the map outgrows its table and
+ * returns the size of the next one. Table sizes need not be powers of two, so the policy may grow by a factor such as
+ * 1.5, by a fixed number of slots or in any other way that suits the memory at hand. Sizes not greater than the
+ * current one are replaced by twice the current size. The default policy doubles the table size.
+ * @param growth Some growth policy or NULL for the default.
+ * @return Self.
+ */
+axhashmap *axh_setGrowth(axhashmap *h, uint64_t (*growth)(uint64_t));
+
+/**
+ * Get the currently used growth policy.
+ * @return Growth policy of self.
+ */
+uint64_t (*axh_getGrowth(axhashmap *h))(uint64_t);
+
 /**
  * Set comparator function. When two mappings' hashes are equal in dynamic span mode, this function is used
  * to determine their actual equality by passing it the keys. If toHash() is set to its default, the default comparator
@@ -120,7 +204,8 @@ bool (*axh_getComparator(axhashmap *h))(const void *, const void *);
 /**
  * Set toHash() function. The hashmap uses this function to pass a key and its hashing function so the
  * user may compute the hash themselves however they see fit in dynamic span mode. toHash() shall return
- * the hash to be used in the table. The default toHash() function hashes a null-terminated C string.
+ * the hash to be used in the table. Only the upper 56 bits of that hash are used, since the table keeps each
+ * mapping's probe length in the lowest 8 bits. The default toHash() function hashes a null-terminated C string.
  * @param toHash Some function satisfying toHash()'s requirements or NULL for the default.
  * @return Self.
  */
@@ -145,9 +230,68 @@ axhashmap *axh_setDestructor(axhashmap *h, void (*destroy)(void *, void *));
  */
 void (*axh_getDestructor(axhashmap *h))(void *, void *);
 
+/**
+ * Enable or disable metadata mode. In metadata mode the map keeps one control byte per slot alongside the table,
+ * holding 7 bits of the slot's hash. Lookups then compare a whole group of 16 (SSE2) or 32 (AVX2) control bytes at
+ * once instead of loading every slot of the probe sequence, which mostly benefits misses and long probe chains.
+ * The table size is at least one group wide while this mode is active.
+ * @param enable True to build the control bytes, false to drop them.
+ * @return True if OOM, else false. Mappings are unaffected on failure.
+ */
+bool axh_setMetadata(axhashmap *h, bool enable);
+
+/**
+ * Whether metadata mode is active.
+ * @return True iff the map keeps control bytes.
+ */
+bool axh_hasMetadata(axhashmap *h);
+
+/**
+ * Let the map own copies of its keys and values, stored in an arena. Keys are copied when a new mapping is created,
+ * taking up static span many bytes or, in dynamic span mode with the default toHash(), the C string including its
+ * terminator. Keys of maps created by axh_newStrings() are copied along with their bytes, which the copy's data
+ * points to and which are null-terminated. If valueSpan is not 0, valueSpan bytes of every non-NULL value are copied
+ * as well. Keys and values passed to the map then need not outlive the call, and the map hands out its copies
+ * instead. The arena allocates from large chunks, so creating mappings does not call malloc for every key. Space of
+ * unmapped and replaced mappings is recycled for mappings of the same size, and axh_clear() releases all of it at
+ * once. A destructor, if set, is still called before the copies are released. Inline keys are never copied, since
+ * they are stored in the table. This can only be changed while the map is empty.
+ * @param ownKeys Whether to copy keys.
+ * @param valueSpan Number of bytes of each value to copy or 0 to store values as given.
+ * @return True if OOM, the map is not empty or keys cannot be copied in this span mode, else false.
+ */
+bool axh_setArena(axhashmap *h, bool ownKeys, uint64_t valueSpan);
+
+/**
+ * Enable or disable incremental resizing. When the map grows in this mode, the new table is allocated right away but
+ * mappings are moved over from the old table in small batches by subsequent operations on the map, lookups included,
+ * rather than all at once. This bounds the latency of every single operation at the cost of consulting both tables
+ * for as long as the migration lasts. Disabling this mode finishes any migration in progress.
+ * @param enable True to enable, false to disable.
+ * @return Self.
+ */
+axhashmap *axh_setIncremental(axhashmap *h, bool enable);
+
+/**
+ * Whether incremental resizing is enabled.
+ * @return True iff incremental resizing is enabled.
+ */
+bool axh_getIncremental(axhashmap *h);
+
+/**
+ * Let tables of at least 2 MiB be aligned to huge pages and ask the kernel to back them by such, which reduces TLB
+ * misses on large tables. Tables of at least 64 KiB are aligned to cache lines regardless. Takes effect on the next
+ * table allocated and requires an allocator with aligned allocations.
+ * @param enable True to use huge pages, false to not.
+ * @return Self.
+ */
+axhashmap *axh_setHugePages(axhashmap *h, bool enable);
+
 /**
  * Set custom memory functions. All three of them must be set and be compatible with one another. Passing NULL for any
- * function will activate its standard library counterpart.
+ * function will activate its standard library counterpart. These functions are used by all maps created without an
+ * allocator of their own, so they must not be changed while any such map exists. See axh_newWith() for per-map
+ * memory functions.
  * @param malloc_fn The malloc function.
  * @param calloc_fn The calloc function.
  * @param free_fn The free function.
@@ -164,6 +308,23 @@ void axh_memoryfn(void *(*malloc_fn)(size_t), void *(*calloc_fn)(size_t, size_t)
  */
 axhashmap *axh_newSized(uint64_t span, uint64_t tableSize, double loadFactor);
 
+/**
+ * Create a new hashmap with some custom allocator, table size, load factor and span. The map, its tables and all other
+ * memory belonging to it are allocated through the allocator, which is copied into the map.
+ * @param allocator The memory functions to use.
+ * @param span Span of keys.
+ * @param tableSize Maximum number of allowed mappings, disregarding load factor.
+ * @param loadFactor Load factor.
+ * @return New hashmap or NULL iff OOM.
+ */
+axhashmap *axh_newWith(const axhallocator *allocator, uint64_t span, uint64_t tableSize, double loadFactor);
+
+/**
+ * Get the memory functions of a hashmap, so that structures built around it can allocate through them as well.
+ * @return The allocator of the map, or the functions set by axh_memoryfn() if it was created without one.
+ */
+axhallocator axh_getAllocator(axhashmap *h);
+
 /**
  * Create a new hashmap with default table size and load factor and custom span.
  * @param span Span of keys.
@@ -171,6 +332,38 @@ axhashmap *axh_newSized(uint64_t span, uint64_t tableSize, double loadFactor);
  */
 axhashmap *axh_new(uint64_t span);
 
+/**
+ * Create a new hashmap storing keys inline with some custom table size, load factor and span.
+ * @param span Span of keys, from 1 up to sizeof(void *).
+ * @param tableSize Maximum number of allowed mappings, disregarding load factor.
+ * @param loadFactor Load factor.
+ * @return New hashmap or NULL if OOM or the span is out of range.
+ */
+axhashmap *axh_newInlineSized(uint64_t span, uint64_t tableSize, double loadFactor);
+
+/**
+ * Create a new hashmap storing keys inline with default table size and load factor and custom span.
+ * @param span Span of keys, from 1 up to sizeof(void *).
+ * @return New hashmap or NULL if OOM or the span is out of range.
+ */
+axhashmap *axh_newInline(uint64_t span);
+
+/**
+ * Create a new hashmap for string keys of known length with some custom table size and load factor. Keys passed to
+ * and handed out by the map are pointers to axhstring. The toHash() and comparator functions must be left at their
+ * defaults, which for this map hash and compare the bytes of the strings.
+ * @param tableSize Maximum number of allowed mappings, disregarding load factor.
+ * @param loadFactor Load factor.
+ * @return New hashmap or NULL iff OOM.
+ */
+axhashmap *axh_newStringsSized(uint64_t tableSize, double loadFactor);
+
+/**
+ * Create a new hashmap for string keys of known length with default table size and load factor.
+ * @return New hashmap or NULL iff OOM.
+ */
+axhashmap *axh_newStrings(void);
+
 /**
  * Destroy all mappings if a destructor is available, then free the hashmap.
  */
@@ -185,6 +378,48 @@ void axh_destroy(axhashmap *h);
  */
 bool axh_rehash(axhashmap *h, uint64_t tableSize);
 
+/**
+ * Rehash the map with the smallest table that holds all mappings without exceeding the load factor, if that is
+ * smaller than the current table. The next new mapping may thus grow the table again.
+ * @return True if OOM, else false.
+ */
+bool axh_shrinkToFit(axhashmap *h);
+
+/**
+ * Rehash the map with the smallest table that holds the given number of mappings without exceeding the load factor,
+ * if that is larger than the current table. Mapping up to that many keys then never grows the table. The table size
+ * is computed exactly rather than by the growth policy, so the table is as small as the load factor allows.
+ * @param count Number of mappings to make room for.
+ * @return True if OOM or no table can hold that many mappings at the load factor, else false.
+ */
+bool axh_reserve(axhashmap *h, uint64_t count);
+
+/**
+ * Rehash the map with some table size like axh_rehash(), spreading the work over several threads. The new table is
+ * split into one region of consecutive slots per thread. Since the slot of a mapping grows monotonically with its
+ * hash, every thread finds the mappings of its region within a narrow range of the old table and places them without
+ * synchronizing with the others. Only mappings that would be displaced past the end of a region are placed by the
+ * calling thread afterwards. Tables too small to be worth splitting are rehashed on the calling thread alone.
+ * @param tableSize Size of newly allocated table.
+ * @param threads Maximum number of threads to use, including the calling thread.
+ * @return True if OOM or given table size is less than the number of mappings, else false.
+ */
+bool axh_rehashParallel(axhashmap *h, uint64_t tableSize, unsigned threads);
+
+/**
+ * Map many keys to values at once, spreading the work over several threads. The table is grown to hold all keys
+ * beforehand. Keys are then hashed and grouped by region in parallel and each region is populated by a thread of
+ * its own, as described for axh_rehashParallel(). If a key occurs more than once, which of its values is kept is
+ * unspecified. Maps that are not empty or own their keys are populated like by axh_mapMany() after growing.
+ * @param keys Keys to map.
+ * @param values Array of n values, one for each key.
+ * @param n Number of keys.
+ * @param threads Maximum number of threads to use, including the calling thread.
+ * @return -1 if OOM, else the number of new mappings created. If OOM, the table may have grown already. An empty
+ * map is left empty, while some of the keys may have been mapped into a map that was populated like by axh_mapMany().
+ */
+int64_t axh_buildFrom(axhashmap *h, void **keys, void **values, uint64_t n, unsigned threads);
+
 /**
  * Map a key to some value if it does not already exist.
  * @param key Key.
@@ -203,6 +438,52 @@ int axh_map(axhashmap *h, void *key, void *value);
  */
 int axh_remap(axhashmap *h, void *key, void *value);
 
+/**
+ * Like axh_remap(), but with the hash of the key given, see axh_mapHashed().
+ * @param key Key.
+ * @param value Value.
+ * @param hash Hash of the key.
+ * @return -1 if OOM, 0 if a new mapping was created, 1 if an existing mapping was replaced.
+ */
+int axh_remapHashed(axhashmap *h, void *key, void *value, uint64_t hash);
+
+/**
+ * Like axh_map(), but with the hash of the key given, as computed by axh_hash(). This saves hashing the key again if
+ * its hash is needed anyway, such as to route the key, or if the key is used with several maps that hash alike. Only
+ * the upper 56 bits of the hash are used. Passing any other hash than that of the key corrupts the map.
+ * @param key Key.
+ * @param value Value.
+ * @param hash Hash of the key.
+ * @return -1 if OOM, 0 if a new mapping was created, 1 if the mapping already exists.
+ */
+int axh_mapHashed(axhashmap *h, void *key, void *value, uint64_t hash);
+
+/**
+ * Find the mapping of a key, creating it with a NULL value if it does not exist, and hand out a reference to its value
+ * that may be read and written. Unlike axh_tryGet() followed by axh_map() on a miss, this hashes the key and walks the
+ * table only once, since the walk ends either at the mapping or where a new one belongs. Creating a mapping may grow
+ * the table, but finding one never does. The reference is only valid until the next operation on the map. Maps that
+ * copy their values into an arena are not supported, since the reference would bypass the copy.
+ * @param key Key.
+ * @param value Pointer to where the reference to the value of the mapping will be written.
+ * @return -1 if OOM, the map is memory-mapped or copies its values, 0 if a new mapping was created, 1 if the mapping
+ * already exists.
+ */
+int axh_getOrInsert(axhashmap *h, void *key, void ***value);
+
+/**
+ * Let f be a function taking (key, value, optional argument) and returning a value.
+ * Find the mapping of a key like axh_getOrInsert() and replace its value by what f returns when passed the current
+ * value, which is NULL for a new mapping. This suits counters and other aggregates that are updated in place. The
+ * destructor is not called on the value passed to f.
+ * @param key Key.
+ * @param f A function computing the new value from the current one.
+ * @param arg Some optional argument that is passed to f.
+ * @return -1 if OOM, the map is memory-mapped or copies its values, 0 if a new mapping was created, 1 if an existing
+ * mapping was updated.
+ */
+int axh_upsert(axhashmap *h, void *key, void *(*f)(const void *, void *, void *), void *arg);
+
 /**
  * Convenience function for sets. Calls axh_map() with the key and value being equal.
  * @param key Key and value in one.
@@ -217,6 +498,14 @@ int axh_add(axhashmap *h, void *key);
  */
 bool axh_has(axhashmap *h, void *key);
 
+/**
+ * Like axh_has(), but with the hash of the key given, see axh_mapHashed().
+ * @param key Key with which to search for the mapping.
+ * @param hash Hash of the key.
+ * @return True iff a matching mapping was found.
+ */
+bool axh_hasHashed(axhashmap *h, void *key, uint64_t hash);
+
 /**
  * Get the value of a mapping.
  * @param key Key with which to search for the mapping.
@@ -224,6 +513,14 @@ bool axh_has(axhashmap *h, void *key);
  */
 void *axh_get(axhashmap *h, void *key);
 
+/**
+ * Like axh_get(), but with the hash of the key given, see axh_mapHashed(). A wrong hash merely misses the mapping.
+ * @param key Key with which to search for the mapping.
+ * @param hash Hash of the key.
+ * @return The value or NULL if no mapping was found.
+ */
+void *axh_getHashed(axhashmap *h, void *key, uint64_t hash);
+
 /**
  * Try getting the value of a mapping.
  * @param key Key with which to search for the mapping.
@@ -233,6 +530,58 @@ void *axh_get(axhashmap *h, void *key);
  */
 bool axh_tryGet(axhashmap *h, void *key, void *value);
 
+/**
+ * Like axh_tryGet(), but with the hash of the key given, see axh_mapHashed().
+ * @param key Key with which to search for the mapping.
+ * @param value Pointer to where the value will be written if a matching mapping is found.
+ * @param hash Hash of the key.
+ * @return True iff a matching mapping was found.
+ */
+bool axh_tryGetHashed(axhashmap *h, void *key, void *value, uint64_t hash);
+
+/**
+ * Get the values of many mappings at once. This is equivalent to calling axh_get() for every key, but hashes keys
+ * in small batches and prefetches their slots ahead of probing, so that the cache misses of a batch overlap.
+ * @param keys Keys with which to search for the mappings.
+ * @param n Number of keys.
+ * @param values Array of n elements receiving the value of each mapping or NULL if no mapping was found.
+ * @return Number of keys for which a mapping was found.
+ */
+uint64_t axh_getMany(axhashmap *h, void **keys, uint64_t n, void **values);
+
+/**
+ * Check for many mappings at once. This is the batched counterpart of axh_has(), see axh_getMany().
+ * @param keys Keys with which to search for the mappings.
+ * @param n Number of keys.
+ * @param found Array of n elements receiving whether a matching mapping was found for each key.
+ * @return Number of keys for which a mapping was found.
+ */
+uint64_t axh_hasMany(axhashmap *h, void **keys, uint64_t n, bool *found);
+
+/**
+ * Map many keys to their values if they do not already exist. This is the batched counterpart of axh_map(),
+ * see axh_getMany(). Keys are mapped in order, so of several equal keys only the first one is mapped.
+ * @param keys Keys.
+ * @param values Array of n values, one for each key.
+ * @param n Number of keys.
+ * @return -1 if OOM, in which case only some of the keys may have been mapped, else the number of new mappings.
+ */
+int64_t axh_mapMany(axhashmap *h, void **keys, void **values, uint64_t n);
+
+/**
+ * Map many keys to their values if they do not already exist, like axh_mapMany(), but by rebuilding the table in a
+ * single sweep instead of probing once per key. The table is grown to hold all keys beforehand, the keys are sorted
+ * by the slot they belong to and then merged with the existing mappings into a new table. This pays off when many
+ * keys are mapped at once, about as many as the map already holds or more. Maps that own their keys are populated
+ * like by axh_mapMany(). Keys are mapped in order, so of several equal keys only the first one is mapped.
+ * @param keys Keys.
+ * @param values Array of n values, one for each key.
+ * @param n Number of keys.
+ * @return -1 if OOM, in which case no key has been mapped, but the table may have grown, else the number of new
+ * mappings.
+ */
+int64_t axh_mapBulk(axhashmap *h, void **keys, void **values, uint64_t n);
+
 /**
  * Unmap a mapping if it exists and call the destructor if it is available.
  * @param key Key with which to search for the mapping.
@@ -240,10 +589,30 @@ bool axh_tryGet(axhashmap *h, void *key, void *value);
  */
 bool axh_unmap(axhashmap *h, void *key);
 
+/**
+ * Like axh_unmap(), but with the hash of the key given, see axh_mapHashed(). A wrong hash merely misses the mapping.
+ * @param key Key with which to search for the mapping.
+ * @param hash Hash of the key.
+ * @return True iff a matching mapping was found and unmapped.
+ */
+bool axh_unmapHashed(axhashmap *h, void *key, uint64_t hash);
+
+/**
+ * Unmap many mappings at once and call the destructor on each if it is available. Like axh_filter(), the mappings
+ * are marked first and removed in a single pass afterwards, which only touches the clusters containing any of them.
+ * Keys without a matching mapping are ignored, as are repetitions of a key.
+ * @param keys Keys with which to search for the mappings.
+ * @param n Number of keys.
+ * @return Number of mappings unmapped.
+ */
+uint64_t axh_unmapMany(axhashmap *h, void **keys, uint64_t n);
+
 /**
  * Let f be a predicate taking (key, value, optional argument).
- * Any mapping which does not satisfy the predicate f shall subsequently be unmapped.
- * Unmapped mappings are destroyed if a destructor is available.
+ * Any mapping which satisfies the predicate f, i.e. for which f returns true, shall subsequently be unmapped.
+ * Unmapped mappings are destroyed if a destructor is available. The mappings are marked first and the remaining
+ * ones are moved back in place of the unmapped ones afterwards in a single pass, so unmapping a large share of the
+ * map costs about as much as a single scan of the table.
  * @param f A function acting as the predicate for the filter.
  * @param arg Some optional argument that is passed to f.
  * @return Self.
@@ -260,6 +629,112 @@ axhashmap *axh_filter(axhashmap *h, bool (*f)(const void *, void *, void *), voi
  */
 axhashmap *axh_foreach(axhashmap *h, bool (*f)(const void *, void *, void *), void *arg);
 
+/**
+ * Let f be a predicate taking (key, value, optional argument).
+ * The mappings stored in the slots begin to end - 1 of the table are passed to f in slot order until either the
+ * range is exhausted or f returns false. Splitting [0, axh_tableSize()) into ranges allows scanning the map in
+ * chunks, such as on several threads at once or interleaved with other work, in which case the map must not be
+ * modified in between. An incremental resize in progress is completed first, so scanning on several threads at once
+ * requires that none is in progress, i.e. that this function or axh_iterBegin() has been called beforehand.
+ * @param begin First slot of the range.
+ * @param end Slot past the end of the range, at most axh_tableSize().
+ * @param f A function acting as the predicate for the loop.
+ * @param arg Some optional argument that is passed to f.
+ * @return The slot following the mapping for which f returned false, from which the scan may be resumed, or end if
+ * the range was exhausted.
+ */
+uint64_t axh_foreachRange(axhashmap *h, uint64_t begin, uint64_t end, bool (*f)(const void *, void *, void *),
+                          void *arg);
+
+/*
+ * Cursor over the mappings of a hashmap in slot order. slot is the next slot to be visited and end the slot at which
+ * iteration stops. key and value are those of the mapping most recently returned by axh_iterNext(). Keys of inline
+ * maps point into the table and are only valid until the map is modified. A cursor may be stored and resumed later,
+ * and both slot and end may be set to any range of slots within axh_tableSize().
+ */
+typedef struct axhiter {
+    uint64_t slot;
+    uint64_t end;
+    void *key;
+    void *value;
+} axhiter;
+
+/**
+ * Start iterating over all mappings. An incremental resize in progress is completed first. As long as the map is not
+ * modified, every mapping is visited exactly once. If mappings are created or unmapped in between, some mappings may
+ * be visited twice or not at all, and a rehash invalidates the cursor.
+ * @return Cursor at the first slot of the table.
+ */
+axhiter axh_iterBegin(axhashmap *h);
+
+/**
+ * Advance a cursor to the next mapping.
+ * @param it Cursor created by axh_iterBegin().
+ * @return True iff another mapping was found, in which case its key and value are stored in the cursor.
+ */
+bool axh_iterNext(axhashmap *h, axhiter *it);
+
+/**
+ * Like axh_foreach(), but the table is split into ranges of slots, each of which is scanned by a thread of its own.
+ * Thus f is called from several threads at once. Once f returns false, the threads stop soon after, though f may
+ * still be called a few times. An incremental resize in progress is completed first. Tables too small to be worth
+ * splitting are scanned on the calling thread alone.
+ * @param f A function acting as the predicate for the loop.
+ * @param arg Some optional argument that is passed to f.
+ * @param threads Maximum number of threads to use, including the calling thread.
+ * @return Self.
+ */
+axhashmap *axh_foreachParallel(axhashmap *h, bool (*f)(const void *, void *, void *), void *arg, unsigned threads);
+
+/**
+ * Like axh_filter(), but the table is split into ranges of slots, each of which is handled by a thread of its own.
+ * The mappings for which f returns true are marked first, then the remaining mappings are moved back in place of the
+ * unmapped ones in a single pass over each range. Thus both f and the destructor are called from several threads at
+ * once. The resulting map is the same as after axh_filter(). Tables too small to be worth splitting are filtered on
+ * the calling thread alone, as is the map if OOM.
+ * @param f A function acting as the predicate for the filter.
+ * @param arg Some optional argument that is passed to f.
+ * @param threads Maximum number of threads to use, including the calling thread.
+ * @return Self.
+ */
+axhashmap *axh_filterParallel(axhashmap *h, bool (*f)(const void *, void *, void *), void *arg, unsigned threads);
+
+/**
+ * Let resolve be a function taking (key, value of this map, value of the other map, optional argument) and returning
+ * a value.
+ * Map every key of the other map to its value in this map. Keys that are mapped in both maps keep the value resolve
+ * returns or, if resolve is NULL, their value in this map. The destructor is not called on the replaced value. If
+ * both maps hash keys alike, i.e. have the same static span or the same toHash() function, the hashes stored by the
+ * other map are reused instead of hashing every key again. The table is grown once beforehand to hold all mappings of
+ * both maps, and the other map is visited in slot order, which visits this table in slot order as well, so the merge
+ * makes a single pass over both tables if they are of the same size. The keys of the other map are mapped as they
+ * are, so they must outlive their mappings in this map, unless this map owns its keys. The other map is not modified.
+ * @param other Map whose mappings to merge into this map.
+ * @param resolve A function choosing the value of keys mapped in both maps or NULL to keep the values of this map.
+ * @param arg Some optional argument that is passed to resolve.
+ * @return -1 if OOM, in which case only some of the mappings may have been merged, or if this map is memory-mapped or
+ * would have to refer to the inline keys of the other map, else the number of new mappings.
+ */
+int64_t axh_merge(axhashmap *h, axhashmap *other, void *(*resolve)(const void *, void *, void *, void *), void *arg);
+
+/**
+ * Unmap every mapping whose key is not mapped in the other map and call the destructor on each if it is available.
+ * Like axh_unmapMany(), the mappings are marked first and removed in a single pass afterwards. The hashes stored by
+ * this map are reused for the lookups in the other map if both maps hash keys alike, see axh_merge(). The other map is
+ * not modified.
+ * @param other Map whose keys to keep.
+ * @return Number of mappings unmapped.
+ */
+uint64_t axh_intersect(axhashmap *h, axhashmap *other);
+
+/**
+ * Unmap every mapping whose key is mapped in the other map and call the destructor on each if it is available. This
+ * works like axh_intersect().
+ * @param other Map whose keys to unmap.
+ * @return Number of mappings unmapped.
+ */
+uint64_t axh_difference(axhashmap *h, axhashmap *other);
+
 /**
  * Unmap all mappings and destroy them if a destructor is available.
  * @return Self.
@@ -270,8 +745,87 @@ axhashmap *axh_clear(axhashmap *h);
  * Create an exact copy of a hashmap. That is, all mappings are merely copied to the
  * new hashmap the way they appear in memory instead of being properly rehashed and mapped.
  * Beware that the destructor is not copied along.
- * @return Copy of this hashmap or NULL iff OOM.
+ * @return Copy of this hashmap or NULL if OOM or the map is memory-mapped.
  */
 axhashmap *axh_copy(axhashmap *h);
 
+/**
+ * Take a read-only snapshot of a hashmap, which keeps seeing the mappings as they are now while the map goes on being
+ * modified, and may be read from another thread meanwhile. Rather than copying the table, the map and its snapshots
+ * share it in blocks of at least 2 MiB, kept in an in-memory file. The map is given private copies of just the pages
+ * it writes to, and the next snapshot stores only the blocks written to since the previous one, so its cost is
+ * proportional to the writes in between. The first snapshot after the table was allocated, such as when the map grew,
+ * moves the whole table into the file, and a table shared with snapshots is always resized at once.
+ * Snapshots are read like maps opened by axh_openMapped() and released by axh_destroy(). They share keys and values
+ * with the map, so these must stay valid for as long as any snapshot refers to them. Maps with an arena, whose keys
+ * and values are freed along with their mappings, cannot take snapshots. Snapshots are only supported on Linux.
+ * @return The snapshot or NULL if OOM, the map is read-only or has an arena, or snapshots are not supported.
+ */
+axhashmap *axh_snapshot(axhashmap *h);
+
+/**
+ * Statistics of a hashmap as reported by axh_stats(). The probe length of a mapping is its distance from the slot its
+ * hash points to. The cumulative counters lookups, inserts, probes and compares are only maintained if the library is
+ * compiled with AXH_STATS defined and are always zero otherwise. They count calls locating a key, new mappings, slots
+ * inspected by these lookups, where metadata mode counts whole groups of control bytes instead of slots, and mappings
+ * these lookups compared against the key respectively.
+ */
+typedef struct axhstats {
+    uint64_t probeLengths[AXH_STATS_BUCKETS];   /* number of mappings per probe length, the last bucket takes the rest */
+    double meanProbeLength;
+    uint64_t maxProbeLength;
+    uint64_t rehashes;                          /* tables allocated to grow or rehash the map */
+    uint64_t bytesAllocated;                    /* memory held by the map itself, excluding keys and values */
+    uint64_t lookups;
+    uint64_t inserts;
+    uint64_t probes;
+    uint64_t compares;
+} axhstats;
+
+/**
+ * Gather statistics about this hashmap. This walks the whole table, so it is best not called on every operation.
+ * A copy made by axh_copy() starts out with zeroed counters.
+ * @param stats Where to store the statistics.
+ */
+void axh_stats(axhashmap *h, axhstats *stats);
+
+/**
+ * Memory held by the map itself, that is its tables, control bytes and arena, but not keys and values it does not
+ * own. This is the same as bytesAllocated of axh_stats(), but does not walk the table.
+ * @return Number of bytes.
+ */
+uint64_t axh_memoryUsage(axhashmap *h);
+
+/**
+ * Save a hashmap to a file that axh_openMapped() can use without reinserting any mappings. The file holds the
+ * table as is, including the stored hashes, followed by copies of the keys, which are referred to by their offset
+ * within the file. This requires keys to be of static span, inline or C strings hashed by the default toHash().
+ * If valueSpan is not 0, valueSpan bytes of every non-NULL value are copied into the file as well. Otherwise the
+ * values themselves are saved, which is only meaningful if they are not pointers. The file is specific to the byte
+ * order and pointer size of this machine. It is written under a temporary name first and then renamed to path,
+ * so that maps opened from a previous version of the file are not affected.
+ * @param path Path of the file to write.
+ * @param valueSpan Number of bytes of each value to save or 0 to save the values themselves.
+ * @return True if the map cannot be saved or writing the file failed, else false.
+ */
+bool axh_save(axhashmap *h, const char *path, uint64_t valueSpan);
+
+/**
+ * Open a file written by axh_save() as a read-only hashmap. The file is mapped into memory rather than read, so the
+ * map is ready for lookups immediately, and its pages are only loaded as they are accessed. Keys and values handed out
+ * by the map point into the mapping and stay valid until the map is destroyed. The map compares keys by their bytes
+ * or as C strings, depending on how it was saved; a custom comparator may be set afterwards. Functions that would
+ * modify the map fail: axh_map(), axh_remap() and friends return -1, axh_rehash() and axh_setMetadata() return true,
+ * axh_unmap() returns false, axh_copy() returns NULL and axh_filter() and axh_clear() do nothing.
+ * @param path Path of the file to open.
+ * @return The map or NULL if the file cannot be opened or is not a valid map file, or if OOM.
+ */
+axhashmap *axh_openMapped(const char *path);
+
+/**
+ * Whether this map was opened by axh_openMapped() or taken by axh_snapshot() and therefore is read-only.
+ * @return True iff the map is memory-mapped.
+ */
+bool axh_isMapped(axhashmap *h);
+
 #endif //AXHASH_AXHASHMAP_H
@@ -0,0 +1,254 @@
+//
+// Created by easy on 16.10.26.
+//
+
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef AXHASH_AXHASHMAP_TEMPLATE_H
+#define AXHASH_AXHASHMAP_TEMPLATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+ * Type-specialized variant of axhashmap. AXH_DECLARE(name, KeyT, ValT, hashfn, eqfn) emits a map type called name
+ * together with static inline functions prefixed by name_, all of them using the same Robin-Hood hashing with
+ * backward shifting as axhashmap. Keys and values are stored by value in the table, so there are no spans,
+ * toHash() or comparator functions, and both hashing and comparison can be inlined into the probe loop.
+ *
+ * hashfn must have the signature uint64_t hashfn(KeyT) and eqfn the signature bool eqfn(KeyT, KeyT). Since only the
+ * upper bits of a hash determine the index of a key, the hash function must be well-distributed in those bits.
+ * Hashes are never stored, which keeps a slot as small as KeyT, ValT and a 32-bit probe length. A map from
+ * uint64_t to uint32_t thus takes 16 bytes per slot rather than the 24 bytes of axhashmap.
+ *
+ * Example:
+
+            static uint64_t hashU64(uint64_t x) { return XXH3_64bits(&x, sizeof x); }
+            static bool eqU64(uint64_t a, uint64_t b) { return a == b; }
+            AXH_DECLARE(u64map, uint64_t, uint32_t, hashU64, eqU64)
+
+            u64map *m = u64map_new();
+            u64map_map(m, 42, 7);
+            uint32_t *value = u64map_get(m, 42);
+ */
+
+
+#define AXH_DECLARE(name, KeyT, ValT, hashfn, eqfn)                                                                    \
+                                                                                                                       \
+/* dist is the probe length of the slot plus one, or 0 if the slot is empty. */                                        \
+typedef struct name##_slot {                                                                                           \
+    KeyT key;                                                                                                          \
+    ValT value;                                                                                                        \
+    uint32_t dist;                                                                                                     \
+} name##_slot;                                                                                                         \
+                                                                                                                       \
+typedef struct name {                                                                                                  \
+    name##_slot *table;                                                                                                \
+    uint64_t rehashThreshold;                                                                                          \
+    uint64_t size;                                                                                                     \
+    uint64_t tableSize;                                                                                                \
+    double loadFactor;                                                                                                 \
+} name;                                                                                                                \
+                                                                                                                       \
+static inline uint64_t name##_computeIndex(uint64_t hash, uint64_t tableSize) {                                        \
+    __extension__ typedef unsigned __int128 u128;                                                                      \
+    return (uint64_t) ((u128) hash * (u128) tableSize >> 64);                                                          \
+}                                                                                                                      \
+                                                                                                                       \
+static inline uint64_t name##_next(name *h, uint64_t index) {                                                          \
+    return ++index >= h->tableSize ? 0 : index;                                                                        \
+}                                                                                                                      \
+                                                                                                                       \
+static inline uint64_t name##_size(name *h) {                                                                          \
+    return h->size;                                                                                                    \
+}                                                                                                                      \
+                                                                                                                       \
+static inline uint64_t name##_tableSize(name *h) {                                                                     \
+    return h->tableSize;                                                                                               \
+}                                                                                                                      \
+                                                                                                                       \
+static inline name *name##_setLoadFactor(name *h, double lf) {                                                         \
+    if (lf < 0) lf = 0;                                                                                                \
+    if (lf > 1) lf = 1;                                                                                                \
+    h->loadFactor = lf;                                                                                                \
+    h->rehashThreshold = (uint64_t) ((double) h->tableSize * lf);                                                      \
+    return h;                                                                                                          \
+}                                                                                                                      \
+                                                                                                                       \
+static inline double name##_getLoadFactor(name *h) {                                                                   \
+    return h->loadFactor;                                                                                              \
+}                                                                                                                      \
+                                                                                                                       \
+static inline name *name##_newSized(uint64_t tableSize, double loadFactor) {                                           \
+    tableSize += !tableSize;                                                                                           \
+    name *h = malloc(sizeof *h);                                                                                       \
+    if (!h || !(h->table = calloc(tableSize, sizeof *h->table))) {                                                     \
+        free(h);                                                                                                       \
+        return NULL;                                                                                                   \
+    }                                                                                                                  \
+    h->rehashThreshold = (uint64_t) ((double) tableSize * loadFactor);                                                 \
+    h->size = 0;                                                                                                       \
+    h->tableSize = tableSize;                                                                                          \
+    h->loadFactor = loadFactor;                                                                                        \
+    return h;                                                                                                          \
+}                                                                                                                      \
+                                                                                                                       \
+static inline name *name##_new(void) {                                                                                 \
+    return name##_newSized(16, 2./3.);                                                                                 \
+}                                                                                                                      \
+                                                                                                                       \
+static inline void name##_destroy(name *h) {                                                                           \
+    free(h->table);                                                                                                    \
+    free(h);                                                                                                           \
+}                                                                                                                      \
+                                                                                                                       \
+/* Returns the slot holding the key, or NULL after inserting the mapping. */                                           \
+static inline name##_slot *name##_unsafeMap(name *h, name##_slot kv, bool mightMatch) {                                \
+    uint64_t index = name##_computeIndex(hashfn(kv.key), h->tableSize);                                                \
+    kv.dist = 1;                                                                                                       \
+    for (name##_slot *selection = &h->table[index]; selection->dist; selection = &h->table[index]) {                   \
+        if (mightMatch && selection->dist == kv.dist && eqfn(selection->key, kv.key))                                  \
+            return selection;                                                                                          \
+        if (kv.dist > selection->dist) {                                                                               \
+            name##_slot tmp = *selection;                                                                              \
+            *selection = kv;                                                                                           \
+            kv = tmp;                                                                                                  \
+            mightMatch = false;                                                                                        \
+        }                                                                                                              \
+        ++kv.dist;                                                                                                     \
+        index = name##_next(h, index);                                                                                 \
+    }                                                                                                                  \
+    h->table[index] = kv;                                                                                              \
+    ++h->size;                                                                                                         \
+    return NULL;                                                                                                       \
+}                                                                                                                      \
+                                                                                                                       \
+/* Rehash the map with some table size. Returns true if OOM or the table size is less than the number of mappings. */  \
+static inline bool name##_rehash(name *h, uint64_t tableSize) {                                                        \
+    name h2 = {.tableSize = tableSize};                                                                                \
+    if (tableSize < h->size)                                                                                           \
+        return true;                                                                                                   \
+    if (!(h2.table = calloc(tableSize, sizeof *h2.table)))                                                             \
+        return true;                                                                                                   \
+    for (uint64_t i = 0, mapped = 0; mapped < h->size; ++i) {                                                          \
+        if (h->table[i].dist) {                                                                                        \
+            name##_unsafeMap(&h2, h->table[i], false);                                                                 \
+            ++mapped;                                                                                                  \
+        }                                                                                                              \
+    }                                                                                                                  \
+    free(h->table);                                                                                                    \
+    h->table = h2.table;                                                                                               \
+    h->tableSize = tableSize;                                                                                          \
+    h->rehashThreshold = (uint64_t) ((double) tableSize * h->loadFactor);                                              \
+    return false;                                                                                                      \
+}                                                                                                                      \
+                                                                                                                       \
+/* Returns -1 if OOM, 0 if a new mapping was created, 1 if the mapping already exists. */                              \
+static inline int name##_map(name *h, KeyT key, ValT value) {                                                          \
+    if (h->size >= h->rehashThreshold && name##_rehash(h, h->tableSize * 2))                                           \
+        return -1;                                                                                                     \
+    return name##_unsafeMap(h, (name##_slot) {key, value, 0}, true) != NULL;                                           \
+}                                                                                                                      \
+                                                                                                                       \
+/* Returns -1 if OOM, 0 if a new mapping was created, 1 if an existing mapping was replaced. */                        \
+static inline int name##_remap(name *h, KeyT key, ValT value) {                                                        \
+    if (h->size >= h->rehashThreshold && name##_rehash(h, h->tableSize * 2))                                           \
+        return -1;                                                                                                     \
+    name##_slot *selection = name##_unsafeMap(h, (name##_slot) {key, value, 0}, true);                                 \
+    if (selection) {                                                                                                   \
+        selection->key = key;                                                                                          \
+        selection->value = value;                                                                                      \
+    }                                                                                                                  \
+    return selection != NULL;                                                                                          \
+}                                                                                                                      \
+                                                                                                                       \
+static inline name##_slot *name##_locate(name *h, KeyT key) {                                                          \
+    uint64_t index = name##_computeIndex(hashfn(key), h->tableSize);                                                   \
+    for (uint32_t dist = 1;; ++dist) {                                                                                 \
+        name##_slot *selection = &h->table[index];                                                                     \
+        /* Covers empty slots as well, since their dist is 0. */                                                       \
+        if (selection->dist < dist)                                                                                    \
+            return NULL;                                                                                               \
+        if (selection->dist == dist && eqfn(selection->key, key))                                                      \
+            return selection;                                                                                          \
+        index = name##_next(h, index);                                                                                 \
+    }                                                                                                                  \
+}                                                                                                                      \
+                                                                                                                       \
+static inline bool name##_has(name *h, KeyT key) {                                                                     \
+    return name##_locate(h, key);                                                                                      \
+}                                                                                                                      \
+                                                                                                                       \
+/* Returns a pointer to the value of the mapping, valid until the map is next modified, or NULL. */                    \
+static inline ValT *name##_get(name *h, KeyT key) {                                                                    \
+    name##_slot *selection = name##_locate(h, key);                                                                    \
+    return selection ? &selection->value : NULL;                                                                       \
+}                                                                                                                      \
+                                                                                                                       \
+static inline bool name##_tryGet(name *h, KeyT key, ValT *value) {                                                     \
+    name##_slot *selection = name##_locate(h, key);                                                                    \
+    if (selection)                                                                                                     \
+        *value = selection->value;                                                                                     \
+    return selection;                                                                                                  \
+}                                                                                                                      \
+                                                                                                                       \
+static inline void name##_unsafeUnmap(name *h, uint64_t index) {                                                       \
+    for (uint64_t next = name##_next(h, index); h->table[next].dist > 1; next = name##_next(h, next)) {                \
+        h->table[index] = h->table[next];                                                                              \
+        --h->table[index].dist;                                                                                        \
+        index = next;                                                                                                  \
+    }                                                                                                                  \
+    h->table[index].dist = 0;                                                                                          \
+    --h->size;                                                                                                         \
+}                                                                                                                      \
+                                                                                                                       \
+static inline bool name##_unmap(name *h, KeyT key) {                                                                   \
+    name##_slot *selection = name##_locate(h, key);                                                                    \
+    if (selection)                                                                                                     \
+        name##_unsafeUnmap(h, (uint64_t) (selection - h->table));                                                      \
+    return selection;                                                                                                  \
+}                                                                                                                      \
+                                                                                                                       \
+/* Unmaps every mapping for which f returns true. Returns NULL if the table was full and could not be grown. */        \
+static inline name *name##_filter(name *h, bool (*f)(const KeyT *, ValT *, void *), void *arg) {                       \
+    /* Sweep from an empty slot, so backward shifts never carry a visited mapping in front of the sweep. */            \
+    if (h->size == h->tableSize && name##_rehash(h, h->tableSize * 2))                                                 \
+        return NULL;                                                                                                   \
+    uint64_t start = 0;                                                                                                \
+    while (h->table[start].dist)                                                                                       \
+        ++start;                                                                                                       \
+    for (uint64_t i = 0, index = start; i < h->tableSize; ++i, index = name##_next(h, index)) {                        \
+        name##_slot *selection = &h->table[index];                                                                     \
+        while (selection->dist && f(&selection->key, &selection->value, arg))                                          \
+            name##_unsafeUnmap(h, index);                                                                              \
+    }                                                                                                                  \
+    return h;                                                                                                          \
+}                                                                                                                      \
+                                                                                                                       \
+/* Passes all mappings to f in some unspecified order until either the table is exhausted or f returns false. */       \
+static inline name *name##_foreach(name *h, bool (*f)(const KeyT *, ValT *, void *), void *arg) {                      \
+    name##_slot *selection = h->table;                                                                                 \
+    for (uint64_t passed = 0; passed < h->size; ++selection) {                                                         \
+        if (selection->dist) {                                                                                         \
+            ++passed;                                                                                                  \
+            if (!f(&selection->key, &selection->value, arg))                                                           \
+                return h;                                                                                              \
+        }                                                                                                              \
+    }                                                                                                                  \
+    return h;                                                                                                          \
+}                                                                                                                      \
+                                                                                                                       \
+static inline name *name##_clear(name *h) {                                                                            \
+    for (uint64_t i = 0; i < h->tableSize; ++i)                                                                        \
+        h->table[i].dist = 0;                                                                                          \
+    h->size = 0;                                                                                                       \
+    return h;                                                                                                          \
+}
+
+#endif //AXHASH_AXHASHMAP_TEMPLATE_H
@@ -0,0 +1,212 @@
+//
+// Created by easy on 16.10.26.
+//
+
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+
+#include "axshardmap.h"
+#include <pthread.h>
+
+/* Shards are picked by the low bits of the hash, which axhashmap leaves unused. */
+#define MAX_SHARDS 256
+
+/* One shard per cache line, so that threads locking neighbouring shards do not contend. */
+typedef struct Shard {
+    _Alignas(64) pthread_mutex_t lock;
+    axhashmap *h;
+} Shard;
+
+struct axshardmap {
+    Shard *shards;
+    uint64_t mask;
+    void *shardMemory;
+    axhallocator allocator;
+};
+
+typedef struct ForeachArg {
+    bool (*f)(const void *, void *, void *);
+    void *arg;
+    bool stopped;
+} ForeachArg;
+
+
+static Shard *shardOfHash(axshardmap *m, uint64_t hash) {
+    return &m->shards[hash & m->mask];
+}
+
+static Shard *shardOf(axshardmap *m, void *key) {
+    return shardOfHash(m, axh_hash(m->shards[0].h, key));
+}
+
+static axhashmap *lockShard(Shard *shard) {
+    pthread_mutex_lock(&shard->lock);
+    return shard->h;
+}
+
+static void unlockShard(Shard *shard) {
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static bool foreachShard(const void *key, void *value, void *arg) {
+    ForeachArg *fa = arg;
+    fa->stopped = !fa->f(key, value, fa->arg);
+    return !fa->stopped;
+}
+
+
+axshardmap *axsh_new(axhashmap *h, unsigned shards) {
+    /* Shards are copies of the template, which would duplicate its mappings into shards they do not belong to. */
+    if (axh_size(h))
+        return NULL;
+    uint64_t count = 1;
+    while (count < shards && count < MAX_SHARDS)
+        count <<= 1;
+
+    const axhallocator allocator = axh_getAllocator(h);
+    axshardmap *m = allocator.mallocFn(allocator.context, sizeof *m);
+    if (!m)
+        return NULL;
+    /* The allocator need not support aligned allocations, so the shards are aligned within a larger block. */
+    m->shardMemory = allocator.mallocFn(allocator.context, count * sizeof *m->shards + _Alignof(Shard) - 1);
+    if (!m->shardMemory) {
+        allocator.freeFn(allocator.context, m);
+        return NULL;
+    }
+    m->shards = (Shard *) (((uintptr_t) m->shardMemory + _Alignof(Shard) - 1) & ~(uintptr_t) (_Alignof(Shard) - 1));
+    m->mask = count - 1;
+    m->allocator = allocator;
+
+    uint64_t i = 1;
+    for (; i < count; ++i) {
+        m->shards[i].h = axh_copy(h);
+        if (!m->shards[i].h)
+            break;
+        axh_setDestructor(m->shards[i].h, axh_getDestructor(h));
+    }
+    if (i < count) {
+        while (--i)
+            axh_destroy(m->shards[i].h);
+        allocator.freeFn(allocator.context, m->shardMemory);
+        allocator.freeFn(allocator.context, m);
+        return NULL;
+    }
+
+    m->shards[0].h = h;
+    for (i = 0; i < count; ++i)
+        pthread_mutex_init(&m->shards[i].lock, NULL);
+    return m;
+}
+
+void axsh_destroy(axshardmap *m) {
+    const axhallocator allocator = m->allocator;
+    for (uint64_t i = 0; i <= m->mask; ++i) {
+        axh_destroy(m->shards[i].h);
+        pthread_mutex_destroy(&m->shards[i].lock);
+    }
+    allocator.freeFn(allocator.context, m->shardMemory);
+    allocator.freeFn(allocator.context, m);
+}
+
+unsigned axsh_shards(axshardmap *m) {
+    return (unsigned) m->mask + 1;
+}
+
+uint64_t axsh_size(axshardmap *m) {
+    uint64_t size = 0;
+    for (uint64_t i = 0; i <= m->mask; ++i) {
+        size += axh_size(lockShard(&m->shards[i]));
+        unlockShard(&m->shards[i]);
+    }
+    return size;
+}
+
+int axsh_map(axshardmap *m, void *key, void *value) {
+    const uint64_t hash = axh_hash(m->shards[0].h, key);
+    Shard *shard = shardOfHash(m, hash);
+    const int status = axh_mapHashed(lockShard(shard), key, value, hash);
+    unlockShard(shard);
+    return status;
+}
+
+int axsh_remap(axshardmap *m, void *key, void *value) {
+    const uint64_t hash = axh_hash(m->shards[0].h, key);
+    Shard *shard = shardOfHash(m, hash);
+    const int status = axh_remapHashed(lockShard(shard), key, value, hash);
+    unlockShard(shard);
+    return status;
+}
+
+bool axsh_has(axshardmap *m, void *key) {
+    const uint64_t hash = axh_hash(m->shards[0].h, key);
+    Shard *shard = shardOfHash(m, hash);
+    const bool found = axh_hasHashed(lockShard(shard), key, hash);
+    unlockShard(shard);
+    return found;
+}
+
+void *axsh_get(axshardmap *m, void *key) {
+    const uint64_t hash = axh_hash(m->shards[0].h, key);
+    Shard *shard = shardOfHash(m, hash);
+    void *value = axh_getHashed(lockShard(shard), key, hash);
+    unlockShard(shard);
+    return value;
+}
+
+bool axsh_tryGet(axshardmap *m, void *key, void *value) {
+    const uint64_t hash = axh_hash(m->shards[0].h, key);
+    Shard *shard = shardOfHash(m, hash);
+    const bool found = axh_tryGetHashed(lockShard(shard), key, value, hash);
+    unlockShard(shard);
+    return found;
+}
+
+bool axsh_unmap(axshardmap *m, void *key) {
+    const uint64_t hash = axh_hash(m->shards[0].h, key);
+    Shard *shard = shardOfHash(m, hash);
+    const bool found = axh_unmapHashed(lockShard(shard), key, hash);
+    unlockShard(shard);
+    return found;
+}
+
+axhashmap *axsh_acquire(axshardmap *m, void *key) {
+    return lockShard(shardOf(m, key));
+}
+
+void axsh_release(axshardmap *m, void *key) {
+    unlockShard(shardOf(m, key));
+}
+
+axshardmap *axsh_filter(axshardmap *m, bool (*f)(const void *, void *, void *), void *arg) {
+    for (uint64_t i = 0; i <= m->mask; ++i) {
+        axh_filter(lockShard(&m->shards[i]), f, arg);
+        unlockShard(&m->shards[i]);
+    }
+    return m;
+}
+
+axshardmap *axsh_foreach(axshardmap *m, bool (*f)(const void *, void *, void *), void *arg) {
+    ForeachArg fa = {f, arg, false};
+    for (uint64_t i = 0; i <= m->mask && !fa.stopped; ++i) {
+        axh_foreach(lockShard(&m->shards[i]), foreachShard, &fa);
+        unlockShard(&m->shards[i]);
+    }
+    return m;
+}
+
+axshardmap *axsh_clear(axshardmap *m) {
+    for (uint64_t i = 0; i <= m->mask; ++i) {
+        axh_clear(lockShard(&m->shards[i]));
+        unlockShard(&m->shards[i]);
+    }
+    return m;
+}
+
+void axsh_stats(axshardmap *m, unsigned shard, axhstats *stats) {
+    axh_stats(lockShard(&m->shards[shard]), stats);
+    unlockShard(&m->shards[shard]);
+}
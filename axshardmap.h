@@ -0,0 +1,156 @@
+//
+// Created by easy on 16.10.26.
+//
+
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef AXHASH_AXSHARDMAP_H
+#define AXHASH_AXSHARDMAP_H
+
+#include "axhashmap.h"
+
+/*
+ * axshardmap is a concurrent hashmap for workloads in which many threads write at once. Keys are partitioned over a
+ * power of two number of shards, each of which is an ordinary axhashmap guarded by a mutex of its own. A key's shard
+ * is picked by the lowest bits of its hash as computed by axh_hash(), which the shards ignore, so keys remain evenly
+ * spread over the slots of each shard. Each shard grows independently, thus rehashing one shard only holds up the
+ * threads accessing that very shard.
+ *
+ * All functions are safe to call from any number of threads. Values returned by lookups may be unmapped by other
+ * threads right after the lookup returns. Use axsh_acquire() to keep a shard locked while working with its mappings,
+ * such as to read and update a counter atomically.
+ */
+typedef struct axshardmap axshardmap;
+
+
+/**
+ * Create a new sharded hashmap. The given hashmap serves as the template for every shard: its configuration, such as
+ * span, load factor, toHash(), comparator and destructor, is applied to all of them. It is adopted as the first
+ * shard and must not be used directly anymore.
+ * @param h The empty hashmap to adopt.
+ * @param shards Number of shards, which is rounded up to a power of two and capped at 256.
+ * @return New sharded hashmap or NULL if OOM or h is not empty, in which case h is left untouched.
+ */
+axshardmap *axsh_new(axhashmap *h, unsigned shards);
+
+/**
+ * Destroy all mappings if a destructor is available, then free the sharded hashmap. No other thread may access the
+ * map anymore at this point.
+ */
+void axsh_destroy(axshardmap *m);
+
+/**
+ * Number of shards.
+ * @return Number of shards.
+ */
+unsigned axsh_shards(axshardmap *m);
+
+/**
+ * Number of mappings. The shards are counted one after another, so concurrent writes may or may not be included.
+ * @return Number of mappings.
+ */
+uint64_t axsh_size(axshardmap *m);
+
+/**
+ * Map a key to some value if it does not already exist.
+ * @param key Key.
+ * @param value Value.
+ * @return -1 if OOM, 0 if a new mapping was created, 1 if the mapping already exists.
+ */
+int axsh_map(axshardmap *m, void *key, void *value);
+
+/**
+ * Map a key to some value unconditionally. That is, a new mapping is either created
+ * or an existing matching mapping is replaced. In that case, the destructor (if set)
+ * is called with only the value and NULL in place of the key.
+ * @param key Key.
+ * @param value Value.
+ * @return -1 if OOM, 0 if a new mapping was created, 1 if an existing mapping was replaced.
+ */
+int axsh_remap(axshardmap *m, void *key, void *value);
+
+/**
+ * Checks if a mapping with this key exists.
+ * @param key Key with which to search for the mapping.
+ * @return True iff a matching mapping was found.
+ */
+bool axsh_has(axshardmap *m, void *key);
+
+/**
+ * Get the value of a mapping.
+ * @param key Key with which to search for the mapping.
+ * @return The value or NULL if no mapping was found.
+ */
+void *axsh_get(axshardmap *m, void *key);
+
+/**
+ * Try getting the value of a mapping.
+ * @param key Key with which to search for the mapping.
+ * @param value Pointer to where the value will be written if a matching mapping is found. Nothing is done
+ * otherwise.
+ * @return True iff a matching mapping was found.
+ */
+bool axsh_tryGet(axshardmap *m, void *key, void *value);
+
+/**
+ * Unmap a mapping if it exists and call the destructor if it is available.
+ * @param key Key with which to search for the mapping.
+ * @return True iff a matching mapping was found and unmapped.
+ */
+bool axsh_unmap(axshardmap *m, void *key);
+
+/**
+ * Lock the shard of a key and return it, so that it can be used with the functions of axhashmap until it is released
+ * by axsh_release(). Only mappings of keys belonging to this shard may be created in it, which is the case for
+ * every key for which axsh_acquire() returns the same shard.
+ * @param key Key whose shard to lock.
+ * @return The shard of the key.
+ */
+axhashmap *axsh_acquire(axshardmap *m, void *key);
+
+/**
+ * Unlock a shard locked by axsh_acquire().
+ * @param key The key passed to axsh_acquire().
+ */
+void axsh_release(axshardmap *m, void *key);
+
+/**
+ * Let f be a predicate taking (key, value, optional argument).
+ * All mappings are passed to f in some unspecified order. If f returns true,
+ * the mapping is unmapped. The shards are locked one at a time, so f must not
+ * call functions of the sharded map.
+ * @param f A function acting as the predicate for the filter.
+ * @param arg Some optional argument that is passed to f.
+ * @return Self.
+ */
+axshardmap *axsh_filter(axshardmap *m, bool (*f)(const void *, void *, void *), void *arg);
+
+/**
+ * Let f be a predicate taking (key, value, optional argument).
+ * All mappings are sequentially passed to f in some unspecified order until
+ * either the table is exhausted or f returns false. The shards are locked one
+ * at a time, so f must not call functions of the sharded map.
+ * @param f A function acting as the predicate for the loop.
+ * @param arg Some optional argument that is passed to f.
+ * @return Self.
+ */
+axshardmap *axsh_foreach(axshardmap *m, bool (*f)(const void *, void *, void *), void *arg);
+
+/**
+ * Unmap all mappings and destroy them if a destructor is available.
+ * @return Self.
+ */
+axshardmap *axsh_clear(axshardmap *m);
+
+/**
+ * Gather the statistics of a single shard as axh_stats() does.
+ * @param shard Index of the shard, less than axsh_shards().
+ * @param stats Where to store the statistics.
+ */
+void axsh_stats(axshardmap *m, unsigned shard, axhstats *stats);
+
+#endif //AXHASH_AXSHARDMAP_H
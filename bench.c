@@ -0,0 +1,323 @@
+//
+// Created by easy on 16.10.26.
+//
+
+/*
+ * Benchmark suite for axhashmap. Build it alongside the library, e.g.
+ *
+ *     cc -O2 -march=native bench.c axhashmap.c -lxxhash -o bench
+ *
+ * and run it as ./bench [maximum number of keys] [key type] [distribution]. The key type is one of u64, string or
+ * custom and the distribution one of uniform or zipf. Omitted arguments run every combination, up to 2^22 keys.
+ * Table sizes grow by a factor of four starting at 2^10 keys, which at 24 bytes per slot spans the whole range from
+ * L1 resident tables to tables well beyond the last level cache.
+ *
+ * For every combination of key type, lookup distribution, load factor and number of keys, the following operations
+ * are timed. Each of them is reported in ns per operation and millions of operations per second, together with the
+ * memory held by the map as reported by axh_stats().
+ *
+ *     insert      Mapping n keys into a table presized for the load factor, so no rehash takes place.
+ *     grow        Mapping n keys into a default sized map, rehashing along the way.
+ *     hit         Looking up n keys that are mapped, drawn from the distribution.
+ *     getMany     The same lookups as hit, made through axh_getMany().
+ *     miss        Looking up n keys that are not mapped.
+ *     remap       Remapping n mapped keys drawn from the distribution.
+ *     foreach     Visiting all n mappings, per mapping.
+ *     rehash      Rehashing the map into a table twice the size, per mapping.
+ *     unmap       Unmapping all n keys in random order.
+ *
+ * u64 keys are random 64-bit integers hashed via the static span, string keys are random strings of 16 to 31
+ * lowercase letters hashed by the default toHash(), and custom keys are random 64-bit integers hashed by a custom
+ * toHash() and compared by a custom comparator.
+ *
+ * Running ./bench analysis instead repeats the probe length experiment of analysis.txt through axh_stats(): a table
+ * of 1000000 slots filled with the 32-bit integers from 0 up to load * table size for a range of loads.
+ */
+
+#include "axhashmap.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <xoshiro256starstar.h>
+#include <sys/random.h>
+
+
+enum KeyType {KEY_U64, KEY_STRING, KEY_CUSTOM, KEY_TYPES};
+enum Distribution {DIST_UNIFORM, DIST_ZIPF, DISTRIBUTIONS};
+
+static const char *keyTypeNames[KEY_TYPES] = {"u64", "string", "custom"};
+static const char *distributionNames[DISTRIBUTIONS] = {"uniform", "zipf"};
+static const double loadFactors[] = {0.5, 2./3., 0.9};
+
+/* Skew of the Zipfian distribution, as used by YCSB. */
+#define ZIPF_THETA 0.99
+
+typedef struct Workload {
+    enum KeyType keyType;
+    uint64_t n;
+    void **keys;        /* n keys that get mapped */
+    void **missing;     /* n keys that never get mapped */
+    void **queries;     /* n mapped keys drawn from the distribution */
+    void **shuffled;    /* all mapped keys in random order */
+    void *storage;
+} Workload;
+
+
+static double nanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static double uniform01(struct xsr256ss *seed) {
+    return (double) (xsr256ss(seed) >> 11) * 0x1p-53;
+}
+
+static uint64_t customToHash(const void *key, uint64_t (*_)(const void *, size_t)) {
+    (void) _;
+    uint64_t x = *(const uint64_t *) key;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+static bool customCmp(const void *a, const void *b) {
+    return *(const uint64_t *) a == *(const uint64_t *) b;
+}
+
+static axhashmap *newMap(enum KeyType keyType, uint64_t tableSize, double loadFactor) {
+    axhashmap *h = axh_newSized(keyType == KEY_U64 ? sizeof(uint64_t) : 0, tableSize, loadFactor);
+    if (keyType == KEY_CUSTOM) {
+        axh_setToHash(h, customToHash);
+        axh_setComparator(h, customCmp);
+    }
+    return h;
+}
+
+static void shuffle(void **xs, uint64_t n, struct xsr256ss *seed) {
+    for (uint64_t i = 0; i + 1 < n; ++i) {
+        uint64_t j = i + xsr256ss(seed) % (n - i);
+        void *tmp = xs[i];
+        xs[i] = xs[j];
+        xs[j] = tmp;
+    }
+}
+
+/* Zipfian ranks following Gray et al., "Quickly Generating Billion-Record Synthetic Databases". */
+static void zipfRanks(uint64_t *ranks, uint64_t n, struct xsr256ss *seed) {
+    double zetan = 0;
+    for (uint64_t i = 1; i <= n; ++i)
+        zetan += 1 / pow((double) i, ZIPF_THETA);
+    const double zeta2 = 1 + 1 / pow(2, ZIPF_THETA);
+    const double alpha = 1 / (1 - ZIPF_THETA);
+    const double eta = (1 - pow(2. / (double) n, 1 - ZIPF_THETA)) / (1 - zeta2 / zetan);
+
+    for (uint64_t i = 0; i < n; ++i) {
+        const double u = uniform01(seed);
+        const double uz = u * zetan;
+        if (uz < 1)
+            ranks[i] = 0;
+        else if (uz < zeta2)
+            ranks[i] = 1;
+        else
+            ranks[i] = (uint64_t) ((double) n * pow(eta * u - eta + 1, alpha)) % n;
+    }
+}
+
+static Workload newWorkload(enum KeyType keyType, enum Distribution distribution, uint64_t n, struct xsr256ss *seed) {
+    enum {STRLEN_MIN = 16, STRLEN_MAX = 32};
+    Workload w = {.keyType = keyType, .n = n};
+    w.keys = malloc(n * sizeof *w.keys);
+    w.missing = malloc(n * sizeof *w.missing);
+    w.queries = malloc(n * sizeof *w.queries);
+    w.shuffled = malloc(n * sizeof *w.shuffled);
+
+    if (keyType == KEY_STRING) {
+        char *strings = w.storage = malloc(2 * n * STRLEN_MAX);
+        for (uint64_t i = 0; i < 2 * n; ++i) {
+            char *s = &strings[i * STRLEN_MAX];
+            uint64_t length = STRLEN_MIN + xsr256ss(seed) % (STRLEN_MAX - STRLEN_MIN);
+            for (uint64_t c = 0; c < length; ++c)
+                s[c] = (char) ('a' + xsr256ss(seed) % 26);
+            s[length] = '\0';
+            *(i < n ? &w.keys[i] : &w.missing[i - n]) = s;
+        }
+    } else {
+        uint64_t *ints = w.storage = malloc(2 * n * sizeof *ints);
+        for (uint64_t i = 0; i < 2 * n; ++i) {
+            ints[i] = xsr256ss(seed);
+            *(i < n ? &w.keys[i] : &w.missing[i - n]) = &ints[i];
+        }
+    }
+
+    uint64_t *ranks = malloc(n * sizeof *ranks);
+    if (distribution == DIST_ZIPF) {
+        zipfRanks(ranks, n, seed);
+    } else {
+        for (uint64_t i = 0; i < n; ++i)
+            ranks[i] = xsr256ss(seed) % n;
+    }
+    for (uint64_t i = 0; i < n; ++i)
+        w.queries[i] = w.keys[ranks[i]];
+    free(ranks);
+
+    memcpy(w.shuffled, w.keys, n * sizeof *w.shuffled);
+    shuffle(w.shuffled, n, seed);
+    return w;
+}
+
+static void freeWorkload(Workload *w) {
+    free(w->keys);
+    free(w->missing);
+    free(w->queries);
+    free(w->shuffled);
+    free(w->storage);
+}
+
+static bool visit(const void *key, void *value, void *sum) {
+    (void) key;
+    *(uintptr_t *) sum += (uintptr_t) value;
+    return true;
+}
+
+/* Keeps results alive, so the compiler cannot drop the work that produced them. */
+static volatile uintptr_t sink;
+
+static void report(const Workload *w, enum Distribution distribution, double lf, const char *op,
+                   double elapsed, uint64_t ops, axhashmap *h) {
+    const double perOp = elapsed / (double) ops;
+    axhstats stats;
+    axh_stats(h, &stats);
+    const double tableMiB = (double) stats.bytesAllocated / (1 << 20);
+    printf("%-8s %-8s %5.2f %10lu   %-8s %9.1f %9.2f %10.2f\n",
+           keyTypeNames[w->keyType], distributionNames[distribution], lf, w->n, op, perOp, 1e3 / perOp, tableMiB);
+}
+
+static void benchWorkload(const Workload *w, enum Distribution distribution, double lf) {
+    const uint64_t n = w->n;
+    void **values = malloc(n * sizeof *values);
+    uintptr_t sum = 0;
+    double start;
+
+    axhashmap *grown = newMap(w->keyType, 16, lf);
+    start = nanoseconds();
+    for (uint64_t i = 0; i < n; ++i)
+        axh_map(grown, w->keys[i], w->keys[i]);
+    report(w, distribution, lf, "grow", nanoseconds() - start, n, grown);
+    axh_destroy(grown);
+
+    /* Leave room for one more mapping, since remapping rehashes a crowded map just like mapping does. */
+    axhashmap *h = newMap(w->keyType, (uint64_t) ((double) n / lf) + 2, lf);
+    start = nanoseconds();
+    for (uint64_t i = 0; i < n; ++i)
+        axh_map(h, w->keys[i], w->keys[i]);
+    report(w, distribution, lf, "insert", nanoseconds() - start, n, h);
+
+    start = nanoseconds();
+    for (uint64_t i = 0; i < n; ++i)
+        sum += (uintptr_t) axh_get(h, w->queries[i]);
+    report(w, distribution, lf, "hit", nanoseconds() - start, n, h);
+
+    start = nanoseconds();
+    axh_getMany(h, w->queries, n, values);
+    report(w, distribution, lf, "getMany", nanoseconds() - start, n, h);
+
+    start = nanoseconds();
+    for (uint64_t i = 0; i < n; ++i)
+        sum += axh_has(h, w->missing[i]);
+    report(w, distribution, lf, "miss", nanoseconds() - start, n, h);
+
+    start = nanoseconds();
+    for (uint64_t i = 0; i < n; ++i)
+        axh_remap(h, w->queries[i], w->queries[i]);
+    report(w, distribution, lf, "remap", nanoseconds() - start, n, h);
+
+    start = nanoseconds();
+    axh_foreach(h, visit, &sum);
+    report(w, distribution, lf, "foreach", nanoseconds() - start, n, h);
+
+    start = nanoseconds();
+    axh_rehash(h, axh_tableSize(h) * 2);
+    report(w, distribution, lf, "rehash", nanoseconds() - start, n, h);
+
+    start = nanoseconds();
+    for (uint64_t i = 0; i < n; ++i)
+        axh_unmap(h, w->shuffled[i]);
+    report(w, distribution, lf, "unmap", nanoseconds() - start, n, h);
+
+    sink = sum + (uintptr_t) values[n - 1];
+    axh_destroy(h);
+    free(values);
+}
+
+static void analysis(void) {
+    enum {TABLE_SIZE = 1000000};
+    static const double loads[] = {1./6., 1./5., 1./4., 1./3., 2./5., 1./2., 3./5., 2./3., 7./10., 3./4., 4./5.,
+                                   257./300., 8./9., 9./10., 19./20.};
+    int32_t *ints = malloc(TABLE_SIZE * sizeof *ints);
+    for (int32_t i = 0; i < TABLE_SIZE; ++i)
+        ints[i] = i;
+
+    printf("%-8s %s\n", "Load", "Average probe length");
+    for (size_t l = 0; l < sizeof loads / sizeof *loads; ++l) {
+        axhashmap *h = axh_newSized(sizeof(int32_t), TABLE_SIZE, 1);
+        const uint64_t mapped = (uint64_t) (loads[l] * TABLE_SIZE);
+        for (uint64_t i = 0; i < mapped; ++i)
+            axh_map(h, &ints[i], NULL);
+        axhstats stats;
+        axh_stats(h, &stats);
+        printf("%-8.4f %.3f\n", loads[l], stats.meanProbeLength);
+
+        if (loads[l] == 2./3.) {
+            puts("\nProbe length distribution of load factor 2/3:");
+            for (int i = 0; i < AXH_STATS_BUCKETS; ++i) {
+                printf("#%2d%s = %5.2f%% %lu\n", i, i == AXH_STATS_BUCKETS - 1 ? "+" : "",
+                       100. * (double) stats.probeLengths[i] / (double) mapped, stats.probeLengths[i]);
+            }
+            putchar('\n');
+        }
+        axh_destroy(h);
+    }
+    free(ints);
+}
+
+static int lookupName(const char *name, const char **names, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    }
+    fprintf(stderr, "Unknown argument: %s\n", name);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv) {
+    struct xsr256ss seed;
+    (void) getrandom(&seed, sizeof seed, 0);
+    if (argc > 1 && strcmp(argv[1], "analysis") == 0) {
+        analysis();
+        return 0;
+    }
+    const uint64_t maxKeys = argc > 1 ? strtoull(argv[1], NULL, 0) : 1 << 22;
+    const int onlyKeyType = argc > 2 ? lookupName(argv[2], keyTypeNames, KEY_TYPES) : -1;
+    const int onlyDistribution = argc > 3 ? lookupName(argv[3], distributionNames, DISTRIBUTIONS) : -1;
+
+    printf("%-8s %-8s %5s %10s   %-8s %9s %9s %10s\n",
+           "keys", "dist", "load", "n", "op", "ns/op", "Mops/s", "table MiB");
+    for (int k = 0; k < KEY_TYPES; ++k) {
+        if (onlyKeyType >= 0 && k != onlyKeyType)
+            continue;
+        for (int d = 0; d < DISTRIBUTIONS; ++d) {
+            if (onlyDistribution >= 0 && d != onlyDistribution)
+                continue;
+            for (uint64_t n = 1 << 10; n <= maxKeys; n <<= 2) {
+                Workload w = newWorkload(k, d, n, &seed);
+                for (size_t l = 0; l < sizeof loadFactors / sizeof *loadFactors; ++l)
+                    benchWorkload(&w, d, loadFactors[l]);
+                freeWorkload(&w);
+            }
+        }
+    }
+}
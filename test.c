@@ -3,12 +3,18 @@
 //
 
 #include "axhashmap.h"
+#include "axhashmap_template.h"
+#include "axchashmap.h"
+#include "axshardmap.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <xoshiro256starstar.h>
 #include <sys/random.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
 
 static void shuffleU64(uint64_t *xs, size_t n, struct xsr256ss *seed) {
@@ -65,6 +71,1358 @@ void testRemove(struct xsr256ss *seed) {
 }
 
 
+void testMetadata(struct xsr256ss *seed) {
+    puts("Testing metadata mode...");
+    enum {N = 1000};
+    uint64_t pool[N];
+    uint64_t tmp[N];
+
+    for (int trials = 0; trials < 1000; ++trials) {
+        unsigned removeCount = xsr256ss(seed) % (N + 1);
+        axhashmap *h = axh_new(sizeof(uint64_t));
+        axh_setLoadFactor(h, (double) (xsr256ss(seed) % 100 + 1) / 100.);
+        assert(!axh_setMetadata(h, true));
+
+        for (int i = 0; i < N; ++i)
+            pool[i] = xsr256ss(seed);
+        for (int i = 0; i < N; ++i) {
+            assert(!axh_has(h, &pool[i]));
+            axh_add(h, &pool[i]);
+        }
+
+        memcpy(tmp, pool, N * sizeof *tmp);
+        shuffleU64(tmp, N, seed);
+        for (unsigned i = 0; i < removeCount; ++i) {
+            assert(*(uint64_t *) axh_get(h, &tmp[i]) == tmp[i]);
+            axh_unmap(h, &tmp[i]);
+            assert(!axh_has(h, &tmp[i]));
+        }
+
+        axhashmap *copy = axh_copy(h);
+        assert(!axh_setMetadata(h, trials % 2));
+        for (unsigned i = 0; i < N; ++i) {
+            assert(axh_has(h, &tmp[i]) == (i >= removeCount));
+            assert(axh_has(copy, &tmp[i]) == (i >= removeCount));
+        }
+
+        axh_destroy(copy);
+        axh_destroy(h);
+    }
+
+#ifdef AXH_STATS
+    /* Control bytes must tell the mappings of a group apart, so a miss rarely compares against any mapping. */
+    enum {LARGE = 1 << 17, MISSES = 50000};
+    static uint64_t large[LARGE];
+    axhashmap *h = axh_new(sizeof(uint64_t));
+    assert(!axh_setMetadata(h, true));
+    for (int i = 0; i < LARGE; ++i) {
+        large[i] = xsr256ss(seed);
+        axh_add(h, &large[i]);
+    }
+    axhstats stats;
+    axh_stats(h, &stats);
+    const uint64_t compares = stats.compares;
+    for (int i = 0; i < MISSES; ++i) {
+        uint64_t missing = xsr256ss(seed);
+        assert(!axh_has(h, &missing));
+    }
+    axh_stats(h, &stats);
+    assert(stats.compares - compares < MISSES / 10);
+    axh_destroy(h);
+#endif
+
+    puts("Metadata mode successful.");
+}
+
+
+static bool sumKeys(const void *key, void *value, void *sum) {
+    assert(*(const uint64_t *) key == (uint64_t) value);
+    *(uint64_t *) sum += *(const uint64_t *) key;
+    return true;
+}
+
+void testInline(struct xsr256ss *seed) {
+    puts("Testing inline keys...");
+    enum {N = 1000};
+    uint64_t pool[N];
+
+    for (int trials = 0; trials < 1000; ++trials) {
+        unsigned removeCount = xsr256ss(seed) % (N + 1);
+        axhashmap *h = axh_newInline(sizeof(uint64_t));
+        uint64_t expected = 0, sum = 0;
+
+        for (int i = 0; i < N; ++i) {
+            uint64_t key = xsr256ss(seed);
+            pool[i] = key;
+            axh_map(h, &key, (void *) key);
+        }
+
+        for (unsigned i = 0; i < removeCount; ++i) {
+            uint64_t key = pool[i];
+            assert(axh_get(h, &key) == (void *) pool[i]);
+            axh_unmap(h, &key);
+            assert(!axh_has(h, &key));
+        }
+        for (unsigned i = removeCount; i < N; ++i) {
+            assert(axh_get(h, &pool[i]) == (void *) pool[i]);
+            expected += pool[i];
+        }
+
+        axh_foreach(h, sumKeys, &sum);
+        assert(sum == expected);
+        axh_destroy(h);
+    }
+
+    assert(!axh_newInline(0));
+    assert(!axh_newInline(sizeof(void *) + 1));
+    puts("Inline keys successful.");
+}
+
+
+static bool countMappings(const void *key, void *value, void *count) {
+    (void) key;
+    (void) value;
+    ++*(uint64_t *) count;
+    return true;
+}
+
+static bool isMultiple(const void *key, void *value, void *divisor) {
+    (void) value;
+    return *(const uint64_t *) key % *(const uint64_t *) divisor == 0;
+}
+
+void testIncremental(struct xsr256ss *seed) {
+    puts("Testing incremental resizing...");
+    enum {N = 1000};
+    uint64_t pool[N];
+    uint64_t tmp[N];
+
+    for (int trials = 0; trials < 1000; ++trials) {
+        axhashmap *h = axh_new(sizeof(uint64_t));
+        axh_setIncremental(h, true);
+        axh_setLoadFactor(h, (double) (xsr256ss(seed) % 100 + 1) / 100.);
+        if (trials % 2)
+            assert(!axh_setMetadata(h, true));
+
+        for (int i = 0; i < N; ++i)
+            pool[i] = xsr256ss(seed);
+        for (int i = 0; i < N; ++i) {
+            assert(axh_add(h, &pool[i]) == 0);
+            assert(axh_add(h, &pool[i]) == 1);
+            unsigned j = xsr256ss(seed) % (i + 1);
+            assert(axh_get(h, &pool[j]) == &pool[j]);
+        }
+
+        memcpy(tmp, pool, N * sizeof *tmp);
+        shuffleU64(tmp, N, seed);
+        unsigned removeCount = xsr256ss(seed) % (N + 1);
+        for (unsigned i = 0; i < removeCount; ++i) {
+            assert(axh_unmap(h, &tmp[i]));
+            assert(!axh_has(h, &tmp[i]));
+        }
+
+        uint64_t count = 0;
+        axh_foreach(h, countMappings, &count);
+        assert(count == N - removeCount && axh_size(h) == count);
+        for (unsigned i = 0; i < N; ++i)
+            assert(axh_has(h, &tmp[i]) == (i >= removeCount));
+        axh_destroy(h);
+
+        /* Filter right after a grow, while the mappings are still being migrated. */
+        h = axh_new(sizeof(uint64_t));
+        axh_setIncremental(h, true);
+        axh_setLoadFactor(h, (double) (xsr256ss(seed) % 100 + 1) / 100.);
+        if (trials % 2)
+            assert(!axh_setMetadata(h, true));
+        int mapped = 0;
+        while (mapped < N / 2)
+            axh_add(h, &pool[mapped++]);
+        for (const uint64_t tableSize = axh_tableSize(h); mapped < N && axh_tableSize(h) == tableSize;)
+            axh_add(h, &pool[mapped++]);
+        for (int extra = xsr256ss(seed) % 8; extra-- && mapped < N;)
+            axh_add(h, &pool[mapped++]);
+        const uint64_t divisor = trials % 3 ? 2 : UINT64_MAX;
+        axh_filter(h, isMultiple, (void *) &divisor);
+        for (int i = 0; i < N; ++i)
+            assert(axh_has(h, &pool[i]) == (i < mapped && pool[i] % divisor != 0));
+        axh_destroy(h);
+    }
+
+    puts("Incremental resizing successful.");
+}
+
+
+void testBatch(struct xsr256ss *seed) {
+    puts("Testing batch operations...");
+    enum {N = 1000};
+    uint64_t pool[N];
+    void *keys[N];
+    void *values[N];
+    bool found[N];
+
+    for (int trials = 0; trials < 1000; ++trials) {
+        unsigned mapCount = xsr256ss(seed) % (N + 1);
+        axhashmap *h = axh_new(sizeof(uint64_t));
+
+        for (int i = 0; i < N; ++i) {
+            pool[i] = xsr256ss(seed);
+            keys[i] = &pool[i];
+        }
+        assert(axh_mapMany(h, keys, keys, mapCount) == mapCount);
+        assert(axh_mapMany(h, keys, keys, mapCount) == 0);
+
+        assert(axh_getMany(h, keys, N, values) == mapCount);
+        assert(axh_hasMany(h, keys, N, found) == mapCount);
+        for (unsigned i = 0; i < N; ++i) {
+            assert(values[i] == (i < mapCount ? keys[i] : NULL));
+            assert(found[i] == (i < mapCount));
+        }
+
+        axh_destroy(h);
+    }
+
+    puts("Batch operations successful.");
+}
+
+void testStats(struct xsr256ss *seed) {
+    puts("Testing statistics...");
+    enum {N = 10000};
+    static uint64_t keys[N];
+    axhashmap *h = axh_new(sizeof(uint64_t));
+    axhstats stats;
+
+    axh_stats(h, &stats);
+    assert(stats.rehashes == 0 && stats.maxProbeLength == 0 && stats.meanProbeLength == 0);
+    for (int i = 0; i < N; ++i) {
+        keys[i] = xsr256ss(seed);
+        axh_map(h, &keys[i], NULL);
+    }
+
+    axh_stats(h, &stats);
+    uint64_t total = 0, weighted = 0;
+    for (uint64_t i = 0; i < AXH_STATS_BUCKETS; ++i) {
+        total += stats.probeLengths[i];
+        weighted += i * stats.probeLengths[i];
+    }
+    assert(total == axh_size(h));
+    assert(stats.maxProbeLength >= AXH_STATS_BUCKETS - 1 || stats.meanProbeLength == (double) weighted / N);
+    assert(stats.rehashes > 0);
+    assert(stats.bytesAllocated >= axh_tableSize(h) * 3 * sizeof(void *));
+
+    axh_destroy(h);
+    puts("Statistics successful.");
+}
+
+
+enum {CONCURRENT_KEYS = 1000, CONCURRENT_READERS = 4};
+
+typedef struct ConcurrentReader {
+    axchashmap *m;
+    uint64_t *pool;
+    atomic_bool *done;
+    struct xsr256ss seed;
+} ConcurrentReader;
+
+static void freeValue(void *key, void *value) {
+    (void) key;
+    free(value);
+}
+
+/* Checks that every key found maps to a live copy of itself. */
+static void *checkKeys(axhashmap *h, void *arg) {
+    ConcurrentReader *r = arg;
+    for (int i = 0; i < 16; ++i) {
+        uint64_t *key = &r->pool[xsr256ss(&r->seed) % CONCURRENT_KEYS];
+        uint64_t *value = axh_get(h, key);
+        assert(!value || *value == *key);
+    }
+    return NULL;
+}
+
+static void *concurrentReader(void *arg) {
+    ConcurrentReader *r = arg;
+    while (!atomic_load(r->done)) {
+        uint64_t *key = &r->pool[xsr256ss(&r->seed) % CONCURRENT_KEYS];
+        if (axch_has(r->m, key))
+            axch_get(r->m, key);
+        axch_read(r->m, checkKeys, r);
+    }
+    return NULL;
+}
+
+static uint64_t *newValue(uint64_t key) {
+    uint64_t *value = malloc(sizeof *value);
+    *value = key;
+    return value;
+}
+
+void testConcurrent(struct xsr256ss *seed) {
+    puts("Testing concurrent map...");
+    static uint64_t pool[CONCURRENT_KEYS];
+    static bool mapped[CONCURRENT_KEYS];
+    for (int i = 0; i < CONCURRENT_KEYS; ++i)
+        pool[i] = xsr256ss(seed);
+
+    axhashmap *h = axh_new(sizeof(uint64_t));
+    axh_setDestructor(h, freeValue);
+    axchashmap *m = axch_new(h);
+    atomic_bool done = false;
+    pthread_t threads[CONCURRENT_READERS];
+    ConcurrentReader readers[CONCURRENT_READERS];
+    for (int i = 0; i < CONCURRENT_READERS; ++i) {
+        readers[i] = (ConcurrentReader) {m, pool, &done, *seed};
+        xsr256ss(seed);
+        assert(!pthread_create(&threads[i], NULL, concurrentReader, &readers[i]));
+    }
+
+    for (int ops = 0; ops < 1000; ++ops) {
+        const uint64_t i = xsr256ss(seed) % CONCURRENT_KEYS;
+        switch (xsr256ss(seed) % 4) {
+        case 0: {
+            uint64_t *value = newValue(pool[i]);
+            const int status = axch_map(m, &pool[i], value);
+            assert(status == mapped[i]);
+            if (status)
+                free(value);
+            mapped[i] = true;
+            break;
+        }
+        case 1:
+            assert(axch_remap(m, &pool[i], newValue(pool[i])) == mapped[i]);
+            mapped[i] = true;
+            break;
+        case 2:
+            assert(axch_unmap(m, &pool[i]) == mapped[i]);
+            mapped[i] = false;
+            break;
+        default: {
+            axhashmap *draft = axch_begin(m);
+            for (int j = 0; j < 8; ++j) {
+                const uint64_t k = xsr256ss(seed) % CONCURRENT_KEYS;
+                assert(axh_unmap(draft, &pool[k]) == mapped[k]);
+                mapped[k] = false;
+            }
+            axch_commit(m);
+        }
+        }
+    }
+
+    atomic_store(&done, true);
+    for (int i = 0; i < CONCURRENT_READERS; ++i)
+        pthread_join(threads[i], NULL);
+    uint64_t count = 0;
+    for (int i = 0; i < CONCURRENT_KEYS; ++i) {
+        assert(axch_has(m, &pool[i]) == mapped[i]);
+        count += mapped[i];
+    }
+    assert(axch_size(m) == count);
+    axch_destroy(m);
+    puts("Concurrent map successful.");
+}
+
+
+enum {SHARDED_KEYS = 1000, SHARDED_THREADS = 4, SHARDED_INCREMENTS = 100000};
+
+typedef struct ShardedWriter {
+    axshardmap *m;
+    uint64_t *pool;
+    struct xsr256ss seed;
+} ShardedWriter;
+
+static void *shardedWriter(void *arg) {
+    ShardedWriter *w = arg;
+    for (int i = 0; i < SHARDED_INCREMENTS; ++i) {
+        uint64_t *key = &w->pool[xsr256ss(&w->seed) % SHARDED_KEYS];
+        axhashmap *shard = axsh_acquire(w->m, key);
+        uintptr_t count = (uintptr_t) axh_get(shard, key);
+        assert(axh_remap(shard, key, (void *) (count + 1)) >= 0);
+        axsh_release(w->m, key);
+    }
+    return NULL;
+}
+
+static bool sumCounts(const void *key, void *value, void *sum) {
+    (void) key;
+    *(uintptr_t *) sum += (uintptr_t) value;
+    return true;
+}
+
+void testSharded(struct xsr256ss *seed) {
+    puts("Testing sharded map...");
+    static uint64_t pool[SHARDED_KEYS];
+    for (int i = 0; i < SHARDED_KEYS; ++i)
+        pool[i] = xsr256ss(seed);
+
+    axshardmap *m = axsh_new(axh_new(sizeof(uint64_t)), 5);
+    assert(axsh_shards(m) == 8);
+    pthread_t threads[SHARDED_THREADS];
+    ShardedWriter writers[SHARDED_THREADS];
+    for (int i = 0; i < SHARDED_THREADS; ++i) {
+        writers[i] = (ShardedWriter) {m, pool, *seed};
+        xsr256ss(seed);
+        assert(!pthread_create(&threads[i], NULL, shardedWriter, &writers[i]));
+    }
+    for (int i = 0; i < SHARDED_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+
+    uintptr_t sum = 0;
+    axsh_foreach(m, sumCounts, &sum);
+    assert(sum == SHARDED_THREADS * SHARDED_INCREMENTS);
+
+    uint64_t mapped = 0;
+    for (unsigned i = 0; i < axsh_shards(m); ++i) {
+        axhstats stats;
+        axsh_stats(m, i, &stats);
+        for (int j = 0; j < AXH_STATS_BUCKETS; ++j)
+            mapped += stats.probeLengths[j];
+    }
+    assert(mapped == axsh_size(m));
+
+    for (int i = 0; i < SHARDED_KEYS; ++i) {
+        const bool found = axsh_has(m, &pool[i]);
+        assert(axsh_unmap(m, &pool[i]) == found);
+        assert(!axsh_get(m, &pool[i]));
+    }
+    assert(axsh_size(m) == 0);
+    axsh_destroy(m);
+
+    axhashmap *h = axh_new(sizeof(uint64_t));
+    axh_add(h, &pool[0]);
+    assert(!axsh_new(h, 4));
+    axh_destroy(h);
+    puts("Sharded map successful.");
+}
+
+
+static char *tempPath(void) {
+    static char path[] = "/tmp/axhashmap_test_XXXXXX";
+    strcpy(path + sizeof path - 7, "XXXXXX");
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    return path;
+}
+
+void testSave(struct xsr256ss *seed) {
+    puts("Testing saved maps...");
+    enum {N = 1000};
+    static uint64_t pool[2 * N];
+    static uint64_t values[N];
+    static char strings[N][24];
+
+    for (int trials = 0; trials < 20; ++trials) {
+        const unsigned mapCount = xsr256ss(seed) % (N + 1);
+        for (int i = 0; i < 2 * N; ++i)
+            pool[i] = xsr256ss(seed);
+        axhashmap *ints = trials % 3 ? axh_new(sizeof(uint64_t)) : axh_newInline(sizeof(uint64_t));
+        axhashmap *strs = axh_new(0);
+        assert(!axh_setMetadata(ints, trials % 2));
+        for (unsigned i = 0; i < mapCount; ++i) {
+            values[i] = ~pool[i];
+            snprintf(strings[i], sizeof *strings, "%lu", pool[i]);
+            axh_map(ints, &pool[i], &values[i]);
+            axh_map(strs, strings[i], (void *) (uintptr_t) i);
+        }
+
+        char *path = tempPath();
+        assert(!axh_save(ints, path, sizeof(uint64_t)));
+        axh_destroy(ints);
+        ints = axh_openMapped(path);
+        assert(ints && axh_isMapped(ints) && axh_size(ints) == mapCount);
+        assert(!axh_save(strs, path, 0));
+        axh_destroy(strs);
+        strs = axh_openMapped(path);
+        assert(strs && axh_size(strs) == mapCount);
+        remove(path);
+
+        char missing[24];
+        for (unsigned i = 0; i < N; ++i) {
+            uint64_t *value = axh_get(ints, &pool[i]);
+            assert(i < mapCount ? *value == ~pool[i] : !value);
+            assert(!axh_has(ints, &pool[N + i]));
+            if (i < mapCount)
+                assert((uintptr_t) axh_get(strs, strings[i]) == i);
+            snprintf(missing, sizeof missing, "%lu", pool[N + i]);
+            assert(!axh_has(strs, missing));
+        }
+        assert(axh_map(ints, &pool[N], NULL) == -1 && !axh_unmap(ints, &pool[0]) && !axh_copy(ints));
+        assert(axh_size(ints) == mapCount);
+
+        axh_destroy(ints);
+        axh_destroy(strs);
+    }
+
+    assert(!axh_openMapped("/nonexistent/axhashmap"));
+    puts("Saved maps successful.");
+}
+
+
+void testArena(struct xsr256ss *seed) {
+    puts("Testing arena...");
+    enum {N = 1000};
+    static uint64_t pool[N];
+
+    for (int trials = 0; trials < 100; ++trials) {
+        const unsigned removeCount = xsr256ss(seed) % (N + 1);
+        axhashmap *h = axh_new(0);
+        assert(!axh_setArena(h, true, sizeof(uint64_t)));
+        char key[24];
+        uint64_t value;
+
+        for (int i = 0; i < N; ++i) {
+            pool[i] = xsr256ss(seed);
+            snprintf(key, sizeof key, "%lu", pool[i]);
+            value = pool[i];
+            assert(axh_map(h, key, &value) == 0);
+            assert(axh_map(h, key, &value) == 1);
+        }
+        assert(axh_setArena(h, false, 0));
+
+        for (unsigned i = 0; i < removeCount; ++i) {
+            snprintf(key, sizeof key, "%lu", pool[i]);
+            assert(axh_unmap(h, key));
+        }
+        for (unsigned i = 0; i < N; ++i) {
+            snprintf(key, sizeof key, "%lu", pool[i]);
+            value = ~pool[i];
+            assert(axh_remap(h, key, &value) == (i >= removeCount));
+        }
+
+        axhashmap *copy = axh_copy(h);
+        axh_clear(h);
+        assert(axh_size(h) == 0);
+        for (unsigned i = 0; i < N; ++i) {
+            snprintf(key, sizeof key, "%lu", pool[i]);
+            assert(*(uint64_t *) axh_get(copy, key) == ~pool[i]);
+            assert(!axh_has(h, key));
+        }
+
+        axh_destroy(copy);
+        axh_destroy(h);
+    }
+
+    puts("Arena successful.");
+}
+
+
+/* Once failAt allocations have been made, every further one fails, unless failAt is 0. */
+typedef struct CountingAllocator {
+    int64_t live;
+    uint64_t aligned;
+    uint64_t made;
+    uint64_t failAt;
+} CountingAllocator;
+
+static bool countAllocation(CountingAllocator *counts) {
+    if (counts->failAt && counts->made >= counts->failAt)
+        return false;
+    ++counts->made;
+    ++counts->live;
+    return true;
+}
+
+static void *countingMalloc(void *context, size_t size) {
+    return countAllocation(context) ? malloc(size) : NULL;
+}
+
+static void *countingCalloc(void *context, size_t count, size_t size) {
+    return countAllocation(context) ? calloc(count, size) : NULL;
+}
+
+static void *countingAligned(void *context, size_t alignment, size_t size) {
+    CountingAllocator *counts = context;
+    if (!countAllocation(counts))
+        return NULL;
+    ++counts->aligned;
+    void *p = aligned_alloc(alignment, size);
+    assert((uintptr_t) p % alignment == 0);
+    return p;
+}
+
+static void countingFree(void *context, void *p) {
+    ((CountingAllocator *) context)->live -= p != NULL;
+    free(p);
+}
+
+static void forgetMapping(void *key, void *value) {
+    (void) key;
+    (void) value;
+}
+
+void testAllocator(struct xsr256ss *seed) {
+    puts("Testing allocator...");
+    enum {N = 10000};
+    static uint64_t pool[N];
+    CountingAllocator counts = {0};
+    const axhallocator allocator = {&counts, countingMalloc, countingCalloc, countingAligned, countingFree};
+
+    axhashmap *h = axh_newWith(&allocator, sizeof(uint64_t), 16, AXH_LOADFACTOR);
+    axh_setHugePages(h, true);
+    assert(!axh_setMetadata(h, true));
+    assert(!axh_setArena(h, true, 0));
+    for (int i = 0; i < N; ++i) {
+        pool[i] = xsr256ss(seed);
+        axh_add(h, &pool[i]);
+    }
+    axhashmap *copy = axh_copy(h);
+    for (int i = 0; i < N; i += 2)
+        axh_unmap(copy, &pool[i]);
+    assert(counts.live > 0 && counts.aligned > 0);
+    axh_destroy(h);
+    axh_destroy(copy);
+    assert(counts.live == 0);
+
+    /* Containers built around a map allocate through its allocator as well. */
+    h = axh_newWith(&allocator, sizeof(uint64_t), 16, AXH_LOADFACTOR);
+    axh_setDestructor(h, forgetMapping);
+    int64_t live = counts.live;
+    axchashmap *concurrent = axch_new(h);
+    assert(counts.live == live + 1);
+    for (int i = 0; i < N; ++i)
+        axch_map(concurrent, &pool[i], NULL);
+    for (int i = 0; i < N; i += 2)
+        axch_unmap(concurrent, &pool[i]);
+    axch_destroy(concurrent);
+    assert(counts.live == 0);
+
+    live = counts.live;
+    axshardmap *sharded = axsh_new(axh_newWith(&allocator, sizeof(uint64_t), 16, AXH_LOADFACTOR), 4);
+    assert(counts.live > live + 2 * axsh_shards(sharded));
+    for (int i = 0; i < N; ++i)
+        axsh_map(sharded, &pool[i], NULL);
+    axsh_destroy(sharded);
+    assert(counts.live == 0);
+
+    /* A parallel build that runs out of memory leaves the map empty. */
+    enum {BUILT = 1 << 17};
+    static uint64_t built[BUILT];
+    static void *keys[BUILT];
+    for (int i = 0; i < BUILT; ++i) {
+        built[i] = xsr256ss(seed);
+        keys[i] = &built[i];
+    }
+    for (uint64_t failAt = 1;; ++failAt) {
+        counts.failAt = 0;
+        h = axh_newWith(&allocator, sizeof(uint64_t), BUILT + BUILT / 64, .99);
+        counts.made = 0;
+        counts.failAt = failAt;
+        const int64_t created = axh_buildFrom(h, keys, keys, BUILT, 4);
+        assert(created == -1 ? axh_size(h) == 0 && !axh_has(h, &built[0]) : created == BUILT);
+        axh_destroy(h);
+        if (created != -1)
+            break;
+    }
+    counts.failAt = 0;
+    assert(counts.live == 0);
+
+    puts("Allocator successful.");
+}
+
+
+void testParallel(struct xsr256ss *seed) {
+    puts("Testing parallel construction...");
+    enum {N = 200000};
+    static uint64_t pool[N];
+    static void *keys[N];
+
+    for (int trials = 0; trials < 4; ++trials) {
+        /* Every eighth key repeats an earlier one. */
+        for (int i = 0; i < N; ++i) {
+            pool[i] = i % 8 == 7 ? pool[xsr256ss(seed) % i] : xsr256ss(seed);
+            keys[i] = &pool[i];
+        }
+        axhashmap *h = axh_new(sizeof(uint64_t));
+        assert(!axh_setMetadata(h, trials % 2));
+        const int64_t created = axh_buildFrom(h, keys, keys, N, 1 + trials * 3);
+        assert(created == (int64_t) axh_size(h) && created == N - N / 8);
+        for (int i = 0; i < N; ++i)
+            assert(*(uint64_t *) axh_get(h, &pool[i]) == pool[i]);
+
+        assert(!axh_rehashParallel(h, axh_tableSize(h) * 3 + 1, 4));
+        for (int i = 0; i < N; ++i) {
+            uint64_t missing = xsr256ss(seed);
+            assert(*(uint64_t *) axh_get(h, &pool[i]) == pool[i]);
+            assert(!axh_has(h, &missing));
+        }
+        for (int i = 0; i < N; ++i)
+            axh_unmap(h, &pool[i]);
+        assert(axh_size(h) == 0);
+        axh_destroy(h);
+    }
+
+    puts("Parallel construction successful.");
+}
+
+
+void testBulk(struct xsr256ss *seed) {
+    puts("Testing bulk insertion...");
+    enum {N = 100000};
+    static uint64_t pool[N];
+    static uint64_t first[N];
+    static void *keys[N];
+
+    for (int trials = 0; trials < 8; ++trials) {
+        /* Every eighth key repeats an earlier one, whose value must be kept. */
+        for (int i = 0; i < N; ++i) {
+            first[i] = i;
+            if (i % 8 == 7)
+                first[i] = first[xsr256ss(seed) % i];
+            pool[i] = first[i] == (uint64_t) i ? xsr256ss(seed) : pool[first[i]];
+            keys[i] = &pool[i];
+        }
+        axhashmap *h = axh_new(sizeof(uint64_t));
+        assert(!axh_setMetadata(h, trials % 2));
+        const int existing = trials * N / 16;
+        for (int i = 0; i < existing; ++i)
+            axh_map(h, keys[i], keys[i]);
+        const uint64_t before = axh_size(h);
+        axhstats stats;
+        axh_stats(h, &stats);
+        const uint64_t rehashes = stats.rehashes;
+        const int64_t created = axh_mapBulk(h, keys + existing / 2, keys + existing / 2, N - existing / 2);
+        assert(created == (int64_t) (axh_size(h) - before));
+        /* Growing for the batch takes a single table. */
+        axh_stats(h, &stats);
+        assert(stats.rehashes == rehashes + 1);
+        assert(axh_size(h) == N - N / 8);
+        for (int i = 0; i < N; ++i) {
+            uint64_t missing = xsr256ss(seed);
+            assert(axh_get(h, &pool[i]) == &pool[first[i]]);
+            assert(!axh_has(h, &missing));
+        }
+        for (int i = 0; i < N; ++i)
+            axh_unmap(h, &pool[i]);
+        assert(axh_size(h) == 0);
+        axh_destroy(h);
+    }
+
+    puts("Bulk insertion successful.");
+}
+
+
+static bool visitChunk(const void *key, void *value, void *arg) {
+    uint64_t *visits = arg;
+    assert(key == value);
+    /* Stop every now and then to resume from the returned slot. */
+    return ++*visits % 1000;
+}
+
+void testIterate(struct xsr256ss *seed) {
+    puts("Testing iteration...");
+    enum {N = 50000};
+    static uint64_t pool[N];
+    static uint8_t seen[N];
+
+    for (int trials = 0; trials < 8; ++trials) {
+        axhashmap *h = axh_new(sizeof(uint64_t));
+        assert(!axh_setMetadata(h, trials % 2));
+        axh_setIncremental(h, trials & 2);
+        for (int i = 0; i < N; ++i) {
+            pool[i] = xsr256ss(seed);
+            axh_map(h, &pool[i], &pool[i]);
+        }
+
+        memset(seen, 0, sizeof seen);
+        uint64_t count = 0;
+        for (axhiter it = axh_iterBegin(h); axh_iterNext(h, &it); ++count) {
+            assert(it.key == it.value);
+            ++seen[(uint64_t *) it.value - pool];
+        }
+        assert(count == N);
+        for (int i = 0; i < N; ++i)
+            assert(seen[i] == 1);
+
+        uint64_t visits = 0;
+        const uint64_t chunk = axh_tableSize(h) / 7 + 1;
+        for (uint64_t begin = 0; begin < axh_tableSize(h); begin += chunk) {
+            const uint64_t end = begin + chunk < axh_tableSize(h) ? begin + chunk : axh_tableSize(h);
+            for (uint64_t slot = begin; slot < end;)
+                slot = axh_foreachRange(h, slot, end, visitChunk, &visits);
+        }
+        assert(visits == N);
+        axh_destroy(h);
+    }
+
+    puts("Iteration successful.");
+}
+
+
+static bool isDivisible(const void *key, void *value, void *arg) {
+    (void) value;
+    return *(const uint64_t *) key % *(const uint64_t *) arg == 0;
+}
+
+static bool countParallel(const void *key, void *value, void *arg) {
+    (void) key;
+    (void) value;
+    atomic_fetch_add((atomic_uint_fast64_t *) arg, 1);
+    return true;
+}
+
+void testSweep(struct xsr256ss *seed) {
+    puts("Testing parallel sweeps...");
+    enum {N = 100000};
+    static uint64_t pool[N];
+
+    for (int trials = 0; trials < 4; ++trials) {
+        axhashmap *h = axh_new(sizeof(uint64_t));
+        assert(!axh_setMetadata(h, trials % 2));
+        axh_setLoadFactor(h, trials < 2 ? AXH_LOADFACTOR : 0.95);
+        for (int i = 0; i < N; ++i) {
+            pool[i] = xsr256ss(seed) % (N * 4);
+            axh_map(h, &pool[i], &pool[i]);
+        }
+        axhashmap *copy = axh_copy(h);
+
+        uint64_t divisor = trials + 2;
+        axh_filter(h, isDivisible, &divisor);
+        axh_filterParallel(copy, isDivisible, &divisor, 4);
+        assert(axh_size(h) == axh_size(copy));
+        for (int i = 0; i < N; ++i) {
+            assert(axh_has(copy, &pool[i]) == (pool[i] % divisor != 0));
+            assert(axh_has(h, &pool[i]) == axh_has(copy, &pool[i]));
+        }
+
+        atomic_uint_fast64_t visits = 0;
+        axh_foreachParallel(copy, countParallel, &visits, 4);
+        assert(visits == axh_size(copy));
+        axh_destroy(h);
+        axh_destroy(copy);
+    }
+
+    puts("Parallel sweeps successful.");
+}
+
+
+void testUnmapMany(struct xsr256ss *seed) {
+    puts("Testing bulk removal...");
+    enum {N = 50000};
+    static uint64_t pool[N];
+    static void *keys[N];
+
+    for (int trials = 0; trials < 8; ++trials) {
+        axhashmap *h = axh_new(sizeof(uint64_t));
+        assert(!axh_setMetadata(h, trials % 2));
+        axh_setLoadFactor(h, (double) (xsr256ss(seed) % 100 + 1) / 100.);
+        for (int i = 0; i < N; ++i) {
+            pool[i] = xsr256ss(seed);
+            axh_map(h, &pool[i], &pool[i]);
+        }
+        /* Unmap every third key, some of them twice, along with keys that were never mapped. */
+        static uint64_t missing[N / 10];
+        uint64_t n = 0;
+        for (int i = 0; i < N; i += 3)
+            keys[n++] = &pool[i];
+        for (int i = 0; i < N / 10; ++i) {
+            missing[i] = xsr256ss(seed);
+            keys[n++] = i % 2 ? (void *) &missing[i] : keys[i];
+        }
+        assert(axh_unmapMany(h, keys, n) == (N + 2) / 3);
+        assert(axh_size(h) == N - (N + 2) / 3);
+        for (int i = 0; i < N; ++i)
+            assert(axh_has(h, &pool[i]) == (i % 3 != 0));
+        axh_destroy(h);
+    }
+
+    puts("Bulk removal successful.");
+}
+
+
+void testShrink(struct xsr256ss *seed) {
+    puts("Testing shrinking...");
+    enum {N = 100000};
+    static uint64_t pool[N];
+
+    for (int trials = 0; trials < 4; ++trials) {
+        axhashmap *h = axh_new(sizeof(uint64_t));
+        assert(!axh_setMetadata(h, trials % 2));
+        axh_setIncremental(h, trials & 2);
+        axh_setShrinkFactor(h, 0.1);
+        for (int i = 0; i < N; ++i) {
+            pool[i] = xsr256ss(seed);
+            axh_map(h, &pool[i], &pool[i]);
+        }
+        const uint64_t peak = axh_memoryUsage(h);
+        for (int i = 0; i < N - N / 100; ++i)
+            axh_unmap(h, &pool[i]);
+        assert(axh_memoryUsage(h) < peak / 8);
+        for (int i = 0; i < N; ++i)
+            assert(axh_has(h, &pool[i]) == (i >= N - N / 100));
+
+        /* Hovering around the same size neither grows nor shrinks the table. */
+        axhstats stats;
+        axh_stats(h, &stats);
+        const uint64_t rehashes = stats.rehashes;
+        for (int i = 0; i < 1000; ++i) {
+            axh_map(h, &pool[i], &pool[i]);
+            axh_unmap(h, &pool[i]);
+        }
+        axh_stats(h, &stats);
+        assert(stats.rehashes == rehashes);
+
+        axh_setShrinkFactor(h, 0);
+        assert(!axh_shrinkToFit(h));
+        assert((uint64_t) ((double) axh_tableSize(h) * axh_getLoadFactor(h)) > axh_size(h));
+        assert((uint64_t) ((double) (axh_tableSize(h) - 1) * axh_getLoadFactor(h)) <= axh_size(h));
+        for (int i = N - N / 100; i < N; ++i)
+            assert(axh_get(h, &pool[i]) == &pool[i]);
+        axh_destroy(h);
+    }
+
+    puts("Shrinking successful.");
+}
+
+
+static uint64_t growHalf(uint64_t tableSize) {
+    return tableSize + tableSize / 2;
+}
+
+static uint64_t growStep(uint64_t tableSize) {
+    return tableSize + 1000;
+}
+
+void testGrowth(struct xsr256ss *seed) {
+    puts("Testing growth policies...");
+    enum {N = 100000};
+    static uint64_t pool[N];
+
+    uint64_t (*policies[])(uint64_t) = {growHalf, growStep, NULL};
+    for (int trials = 0; trials < 6; ++trials) {
+        uint64_t (*growth)(uint64_t) = policies[trials % 3];
+        axhashmap *h = axh_new(sizeof(uint64_t));
+        assert(!axh_setMetadata(h, trials % 2));
+        axh_setGrowth(h, growth);
+        uint64_t tableSize = axh_tableSize(h);
+        for (int i = 0; i < N; ++i) {
+            pool[i] = xsr256ss(seed);
+            axh_map(h, &pool[i], &pool[i]);
+            if (axh_tableSize(h) != tableSize) {
+                assert(axh_tableSize(h) == (growth ? growth(tableSize) : 2 * tableSize));
+                tableSize = axh_tableSize(h);
+            }
+        }
+        for (int i = 0; i < N; ++i)
+            assert(axh_get(h, &pool[i]) == &pool[i]);
+        axh_destroy(h);
+
+        /* Reserving room for N mappings rehashes once, to the smallest table the load factor allows. */
+        h = axh_new(sizeof(uint64_t));
+        axh_setLoadFactor(h, (double) (xsr256ss(seed) % 90 + 10) / 100.);
+        assert(!axh_reserve(h, N));
+        tableSize = axh_tableSize(h);
+        assert((uint64_t) ((double) tableSize * axh_getLoadFactor(h)) >= N);
+        assert((uint64_t) ((double) (tableSize - 1) * axh_getLoadFactor(h)) < N);
+        for (int i = 0; i < N; ++i)
+            axh_map(h, &pool[i], &pool[i]);
+        assert(axh_tableSize(h) == tableSize);
+        assert(!axh_reserve(h, N / 2));
+        assert(axh_tableSize(h) == tableSize);
+        for (int i = 0; i < N; ++i)
+            assert(axh_get(h, &pool[i]) == &pool[i]);
+        axh_destroy(h);
+    }
+
+    puts("Growth policies successful.");
+}
+
+
+static void *increment(const void *key, void *value, void *calls) {
+    (void) key;
+    ++*(uint64_t *) calls;
+    return (void *) ((uintptr_t) value + 1);
+}
+
+void testUpsert(struct xsr256ss *seed) {
+    puts("Testing upserts...");
+    enum {N = 1000, M = 20000};
+    uint64_t pool[N];
+    uint64_t counts[N];
+
+    for (int trials = 0; trials < 100; ++trials) {
+        axhashmap *h = trials % 4 == 3 ? axh_newInline(sizeof(uint64_t)) : axh_new(sizeof(uint64_t));
+        assert(!axh_setMetadata(h, trials % 2));
+        axh_setIncremental(h, trials & 2);
+        if (trials % 4 == 2)
+            assert(!axh_setArena(h, true, 0));
+        axh_setLoadFactor(h, (double) (xsr256ss(seed) % 100 + 1) / 100.);
+        for (int i = 0; i < N; ++i) {
+            pool[i] = xsr256ss(seed);
+            counts[i] = 0;
+        }
+
+        uint64_t created = 0, calls = 0;
+        for (int i = 0; i < M; ++i) {
+            const unsigned j = xsr256ss(seed) % N;
+            int status;
+            if (i % 2) {
+                status = axh_upsert(h, &pool[j], increment, &calls);
+            } else {
+                void **value;
+                status = axh_getOrInsert(h, &pool[j], &value);
+                assert(status >= 0 && (*value == NULL) == !status);
+                *value = (void *) ((uintptr_t) *value + 1);
+            }
+            assert(status == (counts[j] != 0));
+            created += !status;
+            ++counts[j];
+        }
+        assert(calls == M / 2);
+        assert(axh_size(h) == created);
+        for (int i = 0; i < N; ++i)
+            assert(axh_get(h, &pool[i]) == (void *) (uintptr_t) counts[i]);
+        axh_destroy(h);
+    }
+
+    axhashmap *h = axh_new(sizeof(uint64_t));
+    assert(!axh_setArena(h, false, sizeof(uint64_t)));
+    void **value;
+    assert(axh_getOrInsert(h, &pool[0], &value) == -1);
+    axh_destroy(h);
+
+    puts("Upserts successful.");
+}
+
+
+void testHashed(struct xsr256ss *seed) {
+    puts("Testing precomputed hashes...");
+    enum {N = 1000};
+    char *strings[N];
+
+    for (int trials = 0; trials < 100; ++trials) {
+        axhashmap *h = axh_new(0);
+        axhashmap *h2 = axh_new(0);
+        assert(!axh_setMetadata(h, trials % 2));
+        axh_setIncremental(h, trials & 2);
+        for (int i = 0; i < N; ++i) {
+            strings[i] = malloc(48);
+            snprintf(strings[i], 48, "%016llx-%llu", (unsigned long long) xsr256ss(seed), (unsigned long long) i);
+        }
+
+        for (int i = 0; i < N; ++i) {
+            const uint64_t hash = axh_hash(h, strings[i]);
+            assert(axh_mapHashed(h, strings[i], strings[i], hash) == 0);
+            assert(axh_mapHashed(h, strings[i], strings[i], hash) == 1);
+            if (i % 2)
+                assert(axh_mapHashed(h2, strings[i], strings[i], hash) == 0);
+        }
+        for (int i = 0; i < N; ++i) {
+            const uint64_t hash = axh_hash(h, strings[i]);
+            assert(axh_getHashed(h, strings[i], hash) == strings[i]);
+            assert(axh_getHashed(h, strings[i], hash ^ 0xff) == strings[i]);
+            assert(axh_getHashed(h2, strings[i], hash) == (i % 2 ? strings[i] : NULL));
+            assert(axh_get(h2, strings[i]) == axh_getHashed(h2, strings[i], hash));
+        }
+        for (int i = 0; i < N; i += 2) {
+            assert(axh_unmapHashed(h, strings[i], axh_hash(h, strings[i])));
+            assert(!axh_unmapHashed(h, strings[i], axh_hash(h, strings[i])));
+        }
+        for (int i = 0; i < N; ++i) {
+            const uint64_t hash = axh_hash(h, strings[i]);
+            void *value = NULL;
+            assert(axh_has(h, strings[i]) == (i % 2));
+            assert(axh_hasHashed(h, strings[i], hash) == (i % 2));
+            assert(axh_tryGetHashed(h, strings[i], &value, hash) == (i % 2));
+            assert(value == (i % 2 ? strings[i] : NULL));
+            assert(axh_remapHashed(h, strings[i], strings[N - 1 - i], hash) == (i % 2));
+            assert(axh_get(h, strings[i]) == strings[N - 1 - i]);
+        }
+
+        axh_destroy(h);
+        axh_destroy(h2);
+        for (int i = 0; i < N; ++i)
+            free(strings[i]);
+    }
+
+    puts("Precomputed hashes successful.");
+}
+
+
+void testLengthStrings(struct xsr256ss *seed) {
+    puts("Testing strings of known length...");
+    enum {N = 1000, MAX_LENGTH = 500};
+    static char bytes[N][MAX_LENGTH];
+    static axhstring strings[N];
+
+    for (int trials = 0; trials < 40; ++trials) {
+        axhashmap *h = axh_newStrings();
+        assert(!axh_setMetadata(h, trials % 2));
+        axh_setIncremental(h, trials & 2);
+        const bool owned = trials & 4;
+        if (owned)
+            assert(!axh_setArena(h, true, 0));
+
+        /* Strings share a common prefix and may contain null bytes, so only their length tells some of them apart. */
+        for (int i = 0; i < N; ++i) {
+            strings[i].length = 100 + xsr256ss(seed) % (MAX_LENGTH - 100);
+            memset(bytes[i], 'x', strings[i].length);
+            for (int j = 0; j < 8; ++j)
+                bytes[i][strings[i].length - 1 - j] = (char) xsr256ss(seed);
+            strings[i].data = bytes[i];
+        }
+        for (int i = 0; i < N; ++i)
+            assert(axh_map(h, &strings[i], (void *) (uintptr_t) i) == 0);
+        for (int i = 0; i < N; ++i) {
+            axhstring copy = {strings[i].length, strings[i].data};
+            axhstring shorter = {strings[i].length - 1, strings[i].data};
+            assert(axh_get(h, &copy) == (void *) (uintptr_t) i);
+            assert(axh_hash(h, &copy) == axh_hash(h, &strings[i]));
+            assert(!axh_has(h, &shorter));
+        }
+        if (owned) {
+            axhiter it = axh_iterBegin(h);
+            while (axh_iterNext(h, &it)) {
+                const axhstring *key = it.key;
+                assert(key->data != bytes[(uintptr_t) it.value] && key->data[key->length] == 0);
+                assert(memcmp(key->data, bytes[(uintptr_t) it.value], key->length) == 0);
+            }
+        }
+        for (int i = 0; i < N; i += 2)
+            assert(axh_unmap(h, &strings[i]));
+        for (int i = 0; i < N; ++i)
+            assert(axh_has(h, &strings[i]) == (i % 2));
+        axh_destroy(h);
+    }
+
+    puts("Strings of known length successful.");
+}
+
+
+static uint64_t u64ToHash(const void *key, uint64_t (*hash)(const void *, size_t)) {
+    return hash(key, sizeof(uint64_t)) * 0x9e3779b97f4a7c15;
+}
+
+static bool u64Cmp(const void *a, const void *b) {
+    return *(const uint64_t *) a == *(const uint64_t *) b;
+}
+
+static void *addValues(const void *key, void *value, void *otherValue, void *conflicts) {
+    (void) key;
+    ++*(uint64_t *) conflicts;
+    return (void *) ((uintptr_t) value + (uintptr_t) otherValue);
+}
+
+/* Maps of the various kinds set operations have to reconcile: static span, inline keys and custom hashing. */
+static axhashmap *newSetOperand(int kind) {
+    axhashmap *h = kind == 1 ? axh_newInline(sizeof(uint64_t)) : axh_new(kind == 2 ? 0 : sizeof(uint64_t));
+    if (kind == 2)
+        axh_setComparator(axh_setToHash(h, u64ToHash), u64Cmp);
+    return h;
+}
+
+void testSetOperations(struct xsr256ss *seed) {
+    puts("Testing set operations...");
+    enum {N = 3000};
+    static uint64_t pool[N];
+
+    for (int trials = 0; trials < 36; ++trials) {
+        /* Keys of the first third are only in a, those of the last third only in b. */
+        axhashmap *a = newSetOperand(trials % 3), *b = newSetOperand(trials / 3 % 3);
+        assert(!axh_setMetadata(a, trials & 4) && !axh_setMetadata(b, trials & 8));
+        for (int i = 0; i < N; ++i) {
+            pool[i] = xsr256ss(seed);
+            if (i < 2 * N / 3)
+                axh_map(a, &pool[i], (void *) 1);
+            if (i >= N / 3)
+                axh_map(b, &pool[i], (void *) 2);
+        }
+
+        axhashmap *merged = axh_copy(a);
+        uint64_t conflicts = 0;
+        const int64_t created = axh_merge(merged, b, addValues, &conflicts);
+        if (trials / 3 % 3 == 1 && trials % 3 != 1) {
+            assert(created == -1);
+        } else {
+            assert(created == N / 3 && conflicts == N / 3 && axh_size(merged) == N);
+            for (int i = 0; i < N; ++i)
+                assert(axh_get(merged, &pool[i]) == (void *) (uintptr_t) (i < N / 3 ? 1 : i < 2 * N / 3 ? 3 : 2));
+            assert(axh_merge(merged, merged, NULL, NULL) == 0 && axh_size(merged) == N);
+        }
+        axh_destroy(merged);
+
+        axhashmap *intersection = axh_copy(a);
+        axhashmap *difference = axh_copy(a);
+        assert(axh_intersect(intersection, b) == N / 3);
+        assert(axh_difference(difference, b) == N / 3);
+        for (int i = 0; i < N; ++i) {
+            assert(axh_has(intersection, &pool[i]) == (i >= N / 3 && i < 2 * N / 3));
+            assert(axh_has(difference, &pool[i]) == (i < N / 3));
+        }
+        assert(axh_intersect(intersection, intersection) == 0 && axh_size(intersection) == N / 3);
+        assert(axh_difference(difference, difference) == N / 3 && axh_size(difference) == 0);
+        axh_destroy(intersection);
+        axh_destroy(difference);
+        axh_destroy(a);
+        axh_destroy(b);
+    }
+
+    puts("Set operations successful.");
+}
+
+
+typedef struct SnapshotCheck {
+    axhashmap *snapshot;
+    const uint64_t *keys;
+    const uint64_t *values;
+    uint64_t n;
+} SnapshotCheck;
+
+static bool sumValues(const void *key, void *value, void *sum) {
+    (void) key;
+    *(uint64_t *) sum += (uintptr_t) value;
+    return true;
+}
+
+/* Whether the snapshot maps exactly the keys with non-zero values to their values. */
+static void *checkSnapshot(void *arg) {
+    const SnapshotCheck *c = arg;
+    uint64_t expected = 0, size = 0, sum = 0;
+    for (uint64_t i = 0; i < c->n; ++i) {
+        assert(axh_get(c->snapshot, (void *) &c->keys[i]) == (void *) (uintptr_t) c->values[i]);
+        expected += c->values[i];
+        size += c->values[i] != 0;
+    }
+    axh_foreach(c->snapshot, sumValues, &sum);
+    assert(axh_size(c->snapshot) == size && sum == expected);
+    return NULL;
+}
+
+void testSnapshot(struct xsr256ss *seed) {
+    puts("Testing snapshots...");
+#ifndef __linux__
+    axhashmap *unsupported = axh_new(sizeof(uint64_t));
+    assert(!axh_snapshot(unsupported));
+    axh_destroy(unsupported);
+    puts("Snapshots not supported.");
+    return;
+#endif
+    enum {N = 1 << 17};
+    static uint64_t pool[N], values[N], old[N], older[N];
+
+    for (int trials = 0; trials < 4; ++trials) {
+        axhashmap *h = axh_newInline(sizeof(uint64_t));
+        assert(!axh_setMetadata(h, trials & 1));
+        axh_setIncremental(h, trials & 2);
+        memset(values, 0, sizeof values);
+        for (int i = 0; i < N; ++i)
+            pool[i] = xsr256ss(seed);
+        for (int i = 0; i < N / 2; ++i)
+            axh_map(h, &pool[i], (void *) (uintptr_t) (values[i] = i + 1));
+
+        axhashmap *s1 = axh_snapshot(h);
+        assert(s1 && axh_isMapped(s1) && !axh_snapshot(s1));
+        memcpy(older, values, sizeof values);
+        for (int i = 0; i < N / 8; ++i)
+            axh_remap(h, &pool[i], (void *) (uintptr_t) (values[i] = 2 * i + 1));
+        for (int i = N / 8; i < N / 4; ++i) {
+            assert(axh_unmap(h, &pool[i]));
+            values[i] = 0;
+        }
+        for (int i = N / 2; i < 5 * N / 8; ++i)
+            axh_map(h, &pool[i], (void *) (uintptr_t) (values[i] = i + 1));
+
+        axhashmap *s2 = axh_snapshot(h);
+        memcpy(old, values, sizeof values);
+        void **value;
+        assert(axh_getOrInsert(h, &pool[0], &value) == 1);
+        *value = (void *) (uintptr_t) (values[0] = 7);
+        assert(axh_upsert(h, &pool[N - 1], increment, &(uint64_t) {0}) == 0);
+        values[N - 1] = (uintptr_t) axh_get(h, &pool[N - 1]);
+        checkSnapshot(&(SnapshotCheck) {s1, pool, older, N});
+        checkSnapshot(&(SnapshotCheck) {s2, pool, old, N});
+        checkSnapshot(&(SnapshotCheck) {h, pool, values, N});
+        axh_destroy(s1);
+
+        /* Readers check s2 while the map keeps changing and grows away from the table it shares. */
+        pthread_t readers[2];
+        SnapshotCheck check = {s2, pool, old, N};
+        for (int i = 0; i < 2; ++i)
+            pthread_create(&readers[i], NULL, checkSnapshot, &check);
+        for (int i = 5 * N / 8; i < N - 1; ++i)
+            axh_map(h, &pool[i], (void *) (uintptr_t) (values[i] = i + 1));
+        for (int i = 0; i < 2; ++i)
+            pthread_join(readers[i], NULL);
+        checkSnapshot(&(SnapshotCheck) {h, pool, values, N});
+
+        axhashmap *s3 = axh_snapshot(h);
+        axh_clear(h);
+        axhashmap *s4 = axh_snapshot(h);
+        checkSnapshot(&(SnapshotCheck) {s2, pool, old, N});
+        checkSnapshot(&(SnapshotCheck) {s3, pool, values, N});
+        memset(old, 0, sizeof old);
+        checkSnapshot(&(SnapshotCheck) {s4, pool, old, N});
+        axh_map(h, &pool[1], (void *) 1);
+        assert(axh_size(h) == 1 && axh_size(s4) == 0 && !axh_get(s4, &pool[1]));
+        axh_destroy(s2);
+        axh_destroy(s3);
+        axh_destroy(h);
+        axh_destroy(s4);
+    }
+
+    axhashmap *h = axh_new(sizeof(uint64_t));
+    assert(!axh_setArena(h, true, 0) && !axh_snapshot(h));
+    axh_destroy(h);
+
+    puts("Snapshots successful.");
+}
+
+
+static uint64_t hashU64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+static bool eqU64(uint64_t a, uint64_t b) {
+    return a == b;
+}
+
+AXH_DECLARE(u64map, uint64_t, uint32_t, hashU64, eqU64)
+
+static bool isOdd(const uint64_t *key, uint32_t *value, void *arg) {
+    (void) arg;
+    assert(*value == (uint32_t) *key);
+    return *key & 1;
+}
+
+void testTemplate(struct xsr256ss *seed) {
+    puts("Testing type-specialized map...");
+    enum {N = 1000};
+    uint64_t pool[N];
+    uint64_t tmp[N];
+
+    for (int trials = 0; trials < 1000; ++trials) {
+        unsigned removeCount = xsr256ss(seed) % (N + 1);
+        u64map *h = u64map_new();
+        u64map_setLoadFactor(h, (double) (xsr256ss(seed) % 100 + 1) / 100.);
+
+        for (int i = 0; i < N; ++i)
+            pool[i] = xsr256ss(seed);
+        for (int i = 0; i < N; ++i) {
+            assert(u64map_map(h, pool[i], (uint32_t) pool[i]) == 0);
+            assert(u64map_map(h, pool[i], 0) == 1);
+        }
+
+        memcpy(tmp, pool, N * sizeof *tmp);
+        shuffleU64(tmp, N, seed);
+        for (unsigned i = 0; i < removeCount; ++i) {
+            assert(*u64map_get(h, tmp[i]) == (uint32_t) tmp[i]);
+            u64map_unmap(h, tmp[i]);
+            assert(!u64map_has(h, tmp[i]));
+        }
+        for (unsigned i = 0; i < N; ++i)
+            assert(u64map_has(h, tmp[i]) == (i >= removeCount));
+
+        u64map_filter(h, isOdd, NULL);
+        for (unsigned i = 0; i < N; ++i)
+            assert(u64map_has(h, tmp[i]) == (i >= removeCount && !(tmp[i] & 1)));
+
+        u64map_destroy(h);
+    }
+
+    puts("Type-specialized map successful.");
+}
+
+
 /* NOTICE: This test is probabilistic and will fail
    frequently if MINLEN is not sufficiently high. */
 void testStrings(struct xsr256ss *seed) {
@@ -151,20 +1509,33 @@ void playground2(void) {
 }
 
 
-void speedtest(struct xsr256ss *seed) {
-    axhashmap *h = axh_sizedNew(sizeof(uint64_t), 105300000, 19./20.);
-    for (uint64_t i = 0; i < 100000000; ++i) {
-        axh_add(h, &i);
-    }
-    //axh_destroy(h);
-}
-
-
 int main(void) {
     struct xsr256ss seed;
     (void) getrandom(&seed, sizeof seed, 0);
-    speedtest(&seed);
-    /*playground1();
+    /*playground1();*/
     testRemove(&seed);
-    testStrings(&seed);*/
+    testStrings(&seed);
+    testMetadata(&seed);
+    testInline(&seed);
+    testTemplate(&seed);
+    testIncremental(&seed);
+    testBatch(&seed);
+    testStats(&seed);
+    testConcurrent(&seed);
+    testSharded(&seed);
+    testSave(&seed);
+    testArena(&seed);
+    testAllocator(&seed);
+    testParallel(&seed);
+    testBulk(&seed);
+    testIterate(&seed);
+    testSweep(&seed);
+    testUnmapMany(&seed);
+    testShrink(&seed);
+    testGrowth(&seed);
+    testUpsert(&seed);
+    testHashed(&seed);
+    testLengthStrings(&seed);
+    testSetOperations(&seed);
+    testSnapshot(&seed);
 }